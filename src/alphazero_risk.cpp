@@ -1,6 +1,26 @@
 ﻿#include "alphazero_risk.h"
 
 
+void calibrateQuantized(std::shared_ptr<AlphaZeroNNGroup> group, const std::vector<NNInputData>& fallback = {}) // Activation ranges of quantized backend from stored samples
+{
+	if (SETTINGS.NN_BACKEND != BACKEND_CPU_INT8)
+	{
+		return;
+	}
+
+	NNTrainDataStorage storage;
+	storage.loadTrainingSamples(SETTINGS.DEFAULT_SAMPLES);
+	if (storage.data.empty() && !fallback.empty())
+	{
+		printf("No stored samples, calibrating on %d benchmark positions\n", (int)fallback.size());
+		for (const NNInputData& in : fallback)
+		{
+			storage.data.push_back(NNTrainData(0, NNInputData(in), NNOutputData()));
+		}
+	}
+	group->calibrate(storage);
+}
+
 void executePlay()
 {
 	std::shared_ptr<AlphaZeroCluster> nnCluster(new AlphaZeroCluster());
@@ -13,8 +33,13 @@ void executePlay()
 	{
 		auto group = nnCluster->initPlayerGroup("az1", SETTINGS.GRAPH_DEF_PB_1);
 		group->loadCheckpoint(SETTINGS.CHECKPOINT_1);
+		calibrateQuantized(group);
 
-		group1 = std::shared_ptr<PlayerGroup>(new AlphaZeroPlayerGroup(group));
+		group1 = std::shared_ptr<PlayerGroup>(new AlphaZeroPlayerGroup(group, SETTINGS.ROOT_TREES_1));
+	}
+	else if (SETTINGS.PLAYER_1 == "hs")
+	{
+		group1 = std::shared_ptr<PlayerGroup>(new AlphaZeroPlayerGroup(SETTINGS.getNumberOfPlayers(), SETTINGS.ROOT_TREES_1));
 	}
 	else if (SETTINGS.PLAYER_1 == "sp")
 	{
@@ -29,8 +54,13 @@ void executePlay()
 	{
 		auto group = nnCluster->initPlayerGroup("az1", SETTINGS.GRAPH_DEF_PB_2);
 		group->loadCheckpoint(SETTINGS.CHECKPOINT_2);
+		calibrateQuantized(group);
 
-		group2 = std::shared_ptr<PlayerGroup>(new AlphaZeroPlayerGroup(group));
+		group2 = std::shared_ptr<PlayerGroup>(new AlphaZeroPlayerGroup(group, SETTINGS.ROOT_TREES_2));
+	}
+	else if (SETTINGS.PLAYER_2 == "hs")
+	{
+		group2 = std::shared_ptr<PlayerGroup>(new AlphaZeroPlayerGroup(SETTINGS.getNumberOfPlayers(), SETTINGS.ROOT_TREES_2));
 	}
 	else if (SETTINGS.PLAYER_2 == "sp")
 	{
@@ -44,6 +74,198 @@ void executePlay()
 	GameResults gr = GameGroup::playGames(group1, group2, SETTINGS.COMPARE_GAMES);
 
 	printf("Games: %d\nDraws:%d\nPlayer 1:%d\nPlayer 2:%d\n", gr.count, gr.draw, gr.players[0].win, gr.players[1].win);
+	NNEvaluationCache::getInstance().logStats();
+}
+
+std::vector<State> getBenchmarkPositions(int count) // Same positions of random play every run
+{
+	RNG.getEngine().seed(SEARCH_BENCHMARK_SEED);
+	std::vector<State> positions;
+	while (positions.size() < count)
+	{
+		State state;
+		state.setLog(false);
+		state.newGame();
+
+		int moves = RNG.rInt() % SEARCH_BENCHMARK_MAX_MOVES;
+		for (int i = 0; i < moves && state.gameStatus() == State::NOT_ENDED; i++)
+		{
+			uint64_t validMoves = UtilityNN::getValidMoves(state);
+			int pick = RNG.rInt() % Utility::popcount(validMoves);
+			for (int j = 0; j < pick; j++)
+			{
+				validMoves &= validMoves - 1;
+			}
+			UtilityNN::makeMove(state, Utility::lm2li(Utility::getFirstBitMask(validMoves)));
+		}
+
+		if (state.gameStatus() == State::NOT_ENDED && Utility::popcount(UtilityNN::getValidMoves(state)) > 1)
+		{
+			positions.push_back(state);
+		}
+	}
+
+	return positions;
+}
+
+/*
+	NN evaluations needed till search agrees with move of longer reference search, on same positions of random play every run.
+	Run with different search settings, e.g. --dag-backup, to compare them.
+*/
+void executeSearchBenchmark()
+{
+	std::shared_ptr<AlphaZeroCluster> nnCluster(new AlphaZeroCluster());
+	nnCluster->initGpus(nnCluster, SETTINGS.NUMBER_OF_GPUS);
+
+	auto group = nnCluster->initPlayerGroup("az_bench", SETTINGS.GRAPH_DEF_PB_1);
+	group->loadCheckpoint(SETTINGS.CHECKPOINT_1);
+	calibrateQuantized(group);
+	std::shared_ptr<AlphaZeroNNId> nn = group->getNN(0);
+
+	std::vector<State> positions = getBenchmarkPositions(SETTINGS.SEARCH_BENCHMARK_POSITIONS);
+
+	std::vector<NNInputData> inputs(positions.begin(), positions.end());
+	std::vector<float> batch(positions.size() * TF_INPUT_TENSOR_SIZE); // Reused like batch input tensor
+	auto startEncoding = std::chrono::steady_clock::now();
+	for (int r = 0; r < SEARCH_BENCHMARK_ENCODINGS; r++)
+	{
+		for (int p = 0; p < inputs.size(); p++)
+		{
+			inputs[p].encode(batch.data() + p * TF_INPUT_TENSOR_SIZE);
+		}
+	}
+	double encodingSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startEncoding).count();
+	float encodingChecksum = std::accumulate(batch.begin(), batch.end(), 0.0f);
+
+	uint64_t evaluations = 0;
+	int agreed = 0;
+	uint64_t treeBytes = 0;
+	uint64_t treeNodes = 0;
+	double selectionSeconds = 0.0;
+	uint64_t simulations = 0;
+	double searchSeconds = 0.0;
+	for (int p = 0; p < positions.size(); p++)
+	{
+		const State& position = positions[p];
+
+		AlphaZeroMCTS reference;
+		for (int i = 0; i < SEARCH_BENCHMARK_REFERENCE_SEARCHES; i++)
+		{
+			reference.simulate(position, nn);
+		}
+		LandIndex referenceMove = reference.pickMove(reference.calculatePolicy(position), false);
+
+		TreeStats stats = reference.getTreeStats();
+		treeBytes += stats.memoryBytes;
+		treeNodes += stats.treeNodes;
+
+		std::shared_ptr<StateSimulations> root = reference.getStorage()->getRoot();
+		auto startSelection = std::chrono::steady_clock::now();
+		for (int i = 0; i < SEARCH_BENCHMARK_SELECTIONS; i++) // PUCT selection on root, visit is backed up at once
+		{
+			root->addValue(root->getNextBestMove(), 0.0f);
+		}
+		selectionSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startSelection).count();
+
+		AlphaZeroMCTS mcts;
+		mcts.setRootTrees(SETTINGS.ROOT_TREES_1); // Reference is always tree parallel
+		for (int i = 0; i < SEARCH_BENCHMARK_REFERENCE_SEARCHES; i++) // Search is continued on same tree
+		{
+			auto startSearch = std::chrono::steady_clock::now();
+			simulations += mcts.simulate(position, nn, true, true);
+			searchSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startSearch).count();
+			if (mcts.pickMove(mcts.calculatePolicy(position), false) == referenceMove)
+			{
+				agreed++;
+				break;
+			}
+		}
+		evaluations += mcts.nnEvaluations;
+		UtilityFormat::printProgress(p + 1, positions.size());
+	}
+	printf("\n");
+
+	printf("Positions: %d\nAgreement with reference: %.3f\nNN evaluations per position: %.1f\n",
+		(int)positions.size(), float(agreed) / positions.size(), float(evaluations) / positions.size());
+	printf("Simulations per second: %.0f\n", simulations / searchSeconds);
+	printf("Bytes per node: %.0f\nNodes per MB of cache: %.0f\nRoot selections per second: %.0f\n",
+		float(treeBytes) / treeNodes, float(treeNodes) * 1024 * 1024 / treeBytes, positions.size() * SEARCH_BENCHMARK_SELECTIONS / selectionSeconds);
+	printf("Input encoding ns per sample: %.1f (checksum %.3f)\n", encodingSeconds * 1e9 / (positions.size() * SEARCH_BENCHMARK_ENCODINGS), encodingChecksum);
+	NNEvaluationCache::getInstance().logStats();
+}
+
+/*
+	End to end NN evaluations per second of batch pipeline at each batch size, positions are queued as searches would queue them.
+	Every round gets new weights version, so no evaluation is served from cache.
+*/
+void executeNNBenchmark()
+{
+	std::shared_ptr<AlphaZeroCluster> nnCluster(new AlphaZeroCluster());
+	nnCluster->initGpus(nnCluster, SETTINGS.NUMBER_OF_GPUS);
+
+	auto group = nnCluster->initPlayerGroup("az_bench", SETTINGS.GRAPH_DEF_PB_1);
+	group->loadCheckpoint(SETTINGS.CHECKPOINT_1);
+	std::shared_ptr<AlphaZeroNNId> nn = group->getNN(0);
+
+	std::vector<State> positions = getBenchmarkPositions(NN_BENCHMARK_MAX_BATCH);
+	std::vector<NNInputData> inputs(positions.begin(), positions.end());
+	calibrateQuantized(group, inputs);
+
+	std::string reference = SETTINGS.NN_BACKEND == BACKEND_CPU_INT8 ? BACKEND_CPU : BACKEND_TF; // Float network on cpu isolates quantization error
+#ifndef _DEBUG
+	if (SETTINGS.NN_BACKEND != BACKEND_TF && InferenceBackend::needsModel(SETTINGS.NN_BACKEND))
+#else
+	if (reference != BACKEND_TF) // Debug build has no tf outputs to compare with
+#endif // !_DEBUG
+	{
+		BackendError error = nn->compareBackend(inputs, reference);
+		printf("Backend %s compared to %s, max policy difference: %g, max value difference: %g, policy KL: %g, value MSE: %g\n",
+			SETTINGS.NN_BACKEND.c_str(), reference.c_str(), error.maxPolicy, error.maxValue, error.policyKL, error.valueMSE);
+		printf("Run of %d samples: %.1f us, %s %.1f us\n", (int)inputs.size(), error.runUs, reference.c_str(), error.referenceRunUs);
+	}
+
+	for (int batchSize = NN_BENCHMARK_MIN_BATCH; batchSize <= NN_BENCHMARK_MAX_BATCH; batchSize *= 2)
+	{
+		SETTINGS.NN_MAX_BATCH = batchSize;
+		for (int i = 0; i < batchSize; i++) // Batch is run as soon as every thread waits
+		{
+			nn->registerThread();
+		}
+
+		std::deque<std::vector<std::future<NNOutputData>>> inFlight;
+		float checksum = 0.0f;
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < NN_BENCHMARK_ROUNDS || !inFlight.empty(); r++)
+		{
+			if (r < NN_BENCHMARK_ROUNDS)
+			{
+				nn->setVersion(NNEvaluationCache::newVersion());
+				std::vector<std::future<NNOutputData>> round;
+				for (int i = 0; i < batchSize; i++)
+				{
+					round.push_back(nn->predictFuture(inputs[i]));
+				}
+				inFlight.push_back(std::move(round));
+			}
+
+			if (inFlight.size() == PIPELINE_SLOTS || r >= NN_BENCHMARK_ROUNDS) // Keep every pipeline stage busy
+			{
+				for (auto& f : inFlight.front())
+				{
+					checksum += f.get().value;
+				}
+				inFlight.pop_front();
+			}
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		for (int i = 0; i < batchSize; i++)
+		{
+			nn->unregisterThread();
+		}
+		printf("Batch size %d: %.0f evaluations per second, %.1f us per batch (checksum %.3f)\n",
+			batchSize, double(batchSize) * NN_BENCHMARK_ROUNDS / seconds, seconds * 1e6 / NN_BENCHMARK_ROUNDS, checksum);
+	}
 }
 
 void executeTrain()
@@ -57,8 +279,15 @@ void executeTrain()
 	auto generateGroup = nnCluster->initPlayerGroup("az_generate", SETTINGS.GRAPH_DEF_PB_1);
 	generateGroup->loadCheckpoint(SETTINGS.DEFAULT_LATEST_CHECKPOINT);
 
+	auto selfPlayGroup = generateGroup; // Comparison games stay on NN_BACKEND
+	if (!SETTINGS.SELF_PLAY_BACKEND.empty() && SETTINGS.SELF_PLAY_BACKEND != SETTINGS.NN_BACKEND)
+	{
+		selfPlayGroup = nnCluster->initPlayerGroup("az_self_play", SETTINGS.GRAPH_DEF_PB_1, SETTINGS.SELF_PLAY_BACKEND);
+		selfPlayGroup->loadCheckpoint(SETTINGS.DEFAULT_LATEST_CHECKPOINT);
+	}
+
 	AlphaZeroTrainer trainer;
-	trainer.train(trainGroup, generateGroup);
+	trainer.train(trainGroup, generateGroup, selfPlayGroup);
 }
 
 void executeAnalysis()
@@ -75,7 +304,7 @@ void executeAnalysis()
 	}
 
 	AlphaZeroNN nn = AlphaZeroNN();
-	nn.loadGraph(SETTINGS.DEFAULT_GRAPH_DEF_PB, AlphaZeroGPU::getDevicePath(0));
+	nn.loadGraph(SETTINGS.DEFAULT_GRAPH_DEF_PB, AlphaZeroGPU::getDevicePath(0), BACKEND_TF);
 	nn.initWeights();
 
 	nn.trainCrossValidation(storage.data, 10);
@@ -159,9 +388,9 @@ void executeTrinData()
 
 void executeProgram()
 {
-	printf("===> Starting program with GPUs: %d, Games per GPU %d, MCTS threads: %d, MCTS simulations %d\n",
+	printf("===> Starting program with GPUs: %d, Games per GPU %d, MCTS concurent simulations: %d, MCTS scheduler threads: %d, MCTS leaves per descent: %d, MCTS simulations %d\n",
 		SETTINGS.NUMBER_OF_GPUS, SETTINGS.NUMBER_OF_CONCURENT_GAMES_PER_GPU,
-		SETTINGS.THREADS_PER_MCTS, SETTINGS.MCTS_SIMULATIONS);
+		SETTINGS.THREADS_PER_MCTS, SETTINGS.MCTS_SCHEDULER_THREADS, SETTINGS.MCTS_LEAVES_PER_DESCENT, SETTINGS.MCTS_SIMULATIONS);
 
 	if (SETTINGS.MODE == "train")
 	{
@@ -183,10 +412,25 @@ void executeProgram()
 	{
 		executeTrinData();
 	}
+	else if (SETTINGS.MODE == "search-bench")
+	{
+		executeSearchBenchmark();
+	}
+	else if (SETTINGS.MODE == "nn-bench")
+	{
+		executeNNBenchmark();
+	}
 }
 
 int main(int argc, char* argv[])
 {
+#if defined(NN_AVX2) && defined(__GNUC__)
+	if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma"))
+	{
+		printf("Build with NN_AVX2 needs cpu with AVX2 and FMA\n");
+		return 1;
+	}
+#endif // NN_AVX2 && __GNUC__
 	LOG.init();
 	SETTINGS.init(argc, argv);
 
@@ -18,3 +18,14 @@
 #include <stdio.h>
 #include <time.h>
 #include <thread>
+#include <chrono>
+
+
+static const int SEARCH_BENCHMARK_SEED = 1; // Positions are same in every benchmark run
+static const int SEARCH_BENCHMARK_MAX_MOVES = 200; // Random moves played from new game
+static const int SEARCH_BENCHMARK_REFERENCE_SEARCHES = 8; // Reference search is continued this many times
+static const int SEARCH_BENCHMARK_SELECTIONS = 100000; // Selections timed on root of each reference tree
+static const int SEARCH_BENCHMARK_ENCODINGS = 2000; // Times all positions are encoded as NN input batch
+static const int NN_BENCHMARK_MIN_BATCH = 16; // Batch sizes of nn-bench mode are doubled from min to max
+static const int NN_BENCHMARK_MAX_BATCH = 256;
+static const int NN_BENCHMARK_ROUNDS = 200; // Batches timed at each batch size
@@ -26,9 +26,14 @@ class Log
 private:
 	std::ofstream improvementLog;
 	std::ofstream benchmarkLog;
+	std::ofstream selfPlayLog;
 	std::ofstream nnTrainingLog;
 	std::ofstream nnPerformanceLog;
 	std::ofstream mctsPerformanceLog;
+	std::ofstream mctsTreeLog;
+	std::ofstream mctsLatencyLog;
+	std::ofstream mctsTreeStatsLog;
+	std::ofstream nnBatchLog;
 
 public:
 	void init()
@@ -63,6 +68,15 @@ public:
 		return benchmarkLog;
 	}
 
+	std::ofstream& getSelfPlayLog()
+	{
+		if (!selfPlayLog.is_open())
+		{
+			selfPlayLog = std::ofstream("log/azr-selfplay-log.txt", std::ofstream::out | std::ofstream::app);
+		}
+		return selfPlayLog;
+	}
+
 	std::ofstream& getNNPerformanceLog()
 	{
 		if (!nnPerformanceLog.is_open())
@@ -81,6 +95,42 @@ public:
 		return mctsPerformanceLog;
 	}
 
+	std::ofstream& getMCTSTreeLog()
+	{
+		if (!mctsTreeLog.is_open())
+		{
+			mctsTreeLog = std::ofstream("log/mcts-tree-log.txt", std::ofstream::out);
+		}
+		return mctsTreeLog;
+	}
+
+	std::ofstream& getMCTSLatencyLog()
+	{
+		if (!mctsLatencyLog.is_open())
+		{
+			mctsLatencyLog = std::ofstream("log/mcts-latency-log.txt", std::ofstream::out);
+		}
+		return mctsLatencyLog;
+	}
+
+	std::ofstream& getNNBatchLog()
+	{
+		if (!nnBatchLog.is_open())
+		{
+			nnBatchLog = std::ofstream("log/nn-batch-log.txt", std::ofstream::out);
+		}
+		return nnBatchLog;
+	}
+
+	std::ofstream& getMCTSTreeStatsLog(bool json)
+	{
+		if (!mctsTreeStatsLog.is_open())
+		{
+			mctsTreeStatsLog = std::ofstream(json ? "log/mcts-tree-stats.json" : "log/mcts-tree-stats.csv", std::ofstream::out);
+		}
+		return mctsTreeStatsLog;
+	}
+
 	static Log& getInstance()
 	{
 		static Log INSTANCE;
@@ -0,0 +1,123 @@
+#include "alphazero_evaluator.h"
+
+NNOutputData HeuristicEvaluator::evaluate(const State& state)
+{
+	uint64_t validMoves = UtilityNN::getValidMoves(state);
+	NNOutputData out(evaluatePrior(state, validMoves));
+	out.value = rolloutDepth > 0 ? rollout(state, out.policy) : evaluateValue(state);
+	return out;
+}
+
+float HeuristicEvaluator::evaluateValue(const State& state)
+{
+	int8_t gameStatus = state.gameStatus();
+	if (gameStatus != State::NOT_ENDED)
+	{
+		return gameStatus == State::DRAW ? 0.0f : (gameStatus == state.getCurrentPlayerTurn() ? 1.0f : -1.0f);
+	}
+
+	const PlayerStatus* ps = state.getCurrentPlayerStatus();
+	const PlayerStatus* eps = state.getEnemyPlayerStatus();
+
+	float ta = ps->totalArmy;
+	float eta = eps->totalArmy;
+	float armyShare = ta + eta > 0.0f ? ta / (ta + eta) : 0.5f;
+
+	float ref = state.calculateReinforcementValue(ps->ownedLands);
+	float eref = state.calculateReinforcementValue(eps->ownedLands);
+	float reinforcementShare = ref + eref > 0.0f ? ref / (ref + eref) : 0.5f;
+
+	float share = HEURISTIC_ARMY_WEIGHT * armyShare + (1.0f - HEURISTIC_ARMY_WEIGHT) * reinforcementShare;
+	return 2.0f * share - 1.0f;
+}
+
+std::vector<float> HeuristicEvaluator::evaluatePrior(const State& state, uint64_t validMoves)
+{
+	std::vector<float> policy(TF_OUTPUT_POLICY_TENSOR_SIZE, 0.0f);
+	int8_t player = state.getCurrentPlayerTurn();
+	RoundPhase phase = state.getRoundPhase();
+
+	float sum = 0.0f;
+	int count = 0;
+	for (int i = 0; i < TF_OUTPUT_POLICY_TENSOR_SIZE; i++)
+	{
+		if ((validMoves & (1ULL << i)) == 0)
+		{
+			continue;
+		}
+
+		LandIndex li = static_cast<LandIndex>(i);
+		float score = 1.0f;
+		if (li == LandIndex::Count)
+		{
+			score = HEURISTIC_SKIP_PRIOR;
+		}
+		else if (phase == RoundPhase::ATTACK) // Win probability proxy, share of losses taken by defender scaled by army ratio
+		{
+			LandIndex from = UtilityNN::getAttackFrom(state, li);
+			if (from != LandIndex::None)
+			{
+				const BattleOutcomes& outcomes = state.getBattleOutcomes(from, li);
+				float attackerLoss = 0.0f;
+				float defenderLoss = 0.0f;
+				for (int o = 0; o < outcomes.size; o++)
+				{
+					attackerLoss += outcomes.outcome[o].probability * outcomes.outcome[o].attackerLosses;
+					defenderLoss += outcomes.outcome[o].probability * outcomes.outcome[o].defenderLosses;
+				}
+				float a = state.getLandArmy(from).army - 1;
+				float d = state.getLandArmy(li).army;
+				score = defenderLoss / (attackerLoss + defenderLoss) * a / (a + d);
+			}
+		}
+		else if (phase == RoundPhase::SETUP || phase == RoundPhase::REINFORCEMENT || phase == RoundPhase::FORTIFY) // Threat of bordering foreign armies
+		{
+			float threat = 0.0f;
+			for (LandIndex n : Land::getLand(li)->neihboursLandIndex)
+			{
+				LandArmy la = state.getLandArmy(n);
+				if (la.playerIndex != player)
+				{
+					threat += la.army;
+				}
+			}
+			score = threat / (threat + state.getLandArmy(li).army + 1.0f);
+		}
+
+		policy[i] = score;
+		sum += score;
+		count++;
+	}
+
+	for (int i = 0; i < TF_OUTPUT_POLICY_TENSOR_SIZE; i++)
+	{
+		if ((validMoves & (1ULL << i)) > 0)
+		{
+			float heuristic = sum > 0.0f ? policy[i] / sum : 1.0f / count;
+			policy[i] = (1.0f - HEURISTIC_UNIFORM_PRIOR) * heuristic + HEURISTIC_UNIFORM_PRIOR / count;
+		}
+	}
+	return policy;
+}
+
+float HeuristicEvaluator::rollout(const State& state, const std::vector<float>& prior)
+{
+	thread_local std::default_random_engine engine(std::random_device{}());
+
+	State s = state;
+	int8_t player = s.getCurrentPlayerTurn();
+	std::vector<float> policy = prior;
+	for (int depth = 0; depth < rolloutDepth && s.gameStatus() == State::NOT_ENDED; depth++)
+	{
+		if (depth > 0)
+		{
+			policy = evaluatePrior(s, UtilityNN::getValidMoves(s));
+		}
+		std::discrete_distribution<int> pick(policy.begin(), policy.end());
+		LandIndex li = static_cast<LandIndex>(pick(engine));
+		UtilityNN::makeMove(s, li, UtilityNN::rollBattleOutcome(s, li, engine)); // Dice from thread engine, not shared global RNG
+	}
+
+	float value = evaluateValue(s);
+	return s.getCurrentPlayerTurn() == player ? value : -value;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "alphazero_moves.h"
+#include "neural_network/alphazero_nn_data.h"
+
+static const float HEURISTIC_ARMY_WEIGHT = 0.5f; // Value weight of army share, rest is reinforcement share
+static const float HEURISTIC_UNIFORM_PRIOR = 0.25f; // Share of uniform prior mixed into heuristic prior, keeps search exploring
+static const float HEURISTIC_SKIP_PRIOR = 0.5f; // Score of ending phase, compared to attack win probability and land threat
+
+
+class LeafEvaluator // Thread safe, replaces or complements NN at MCTS leaves
+{
+public:
+	virtual ~LeafEvaluator() = default;
+	virtual NNOutputData evaluate(const State& state) = 0; // Policy over all moves and value for player on turn
+};
+
+/*
+	Network free evaluation, value from army and reinforcement share, prior from attack odds of battle outcomes and threat of bordering enemy armies.
+	With rollout depth, value is taken after that many moves sampled from heuristic prior.
+*/
+class HeuristicEvaluator : public LeafEvaluator
+{
+private:
+	int rolloutDepth;
+
+public:
+	HeuristicEvaluator(int rolloutDepth) : rolloutDepth(rolloutDepth) {};
+
+	NNOutputData evaluate(const State& state) override;
+
+	static float evaluateValue(const State& state);
+	static std::vector<float> evaluatePrior(const State& state, uint64_t validMoves);
+
+private:
+	float rollout(const State& state, const std::vector<float>& prior);
+};
@@ -15,20 +15,81 @@ void SimulationValue::addValue(float v)
 	{
 		Q = (N * Q + v) / (N + 1);
 	}
+	addVisit();
+}
 
-	N++;
+void SimulationValue::addVisit()
+{
+	if (N < MAX_N) // Saturated count keeps Q as running average with fixed weight
+	{
+		N++;
+	}
 	active_N--;
 }
 
+/////////////////
+// ChanceValue //
+/////////////////
+int ChanceValue::pickOutcome()
+{
+	uint32_t total = 0;
+	for (int i = 0; i < outcomes->size; i++)
+	{
+		total += picked[i];
+	}
+
+	int best = 0;
+	float bestDeficit = -INFINITY;
+	for (int i = 0; i < outcomes->size; i++)
+	{
+		float deficit = outcomes->outcome[i].probability * (total + 1) - picked[i]; // Most under visited outcome
+		if (deficit > bestDeficit)
+		{
+			bestDeficit = deficit;
+			best = i;
+		}
+	}
+
+	picked[best]++;
+	return best;
+}
+
+float ChanceValue::addValue(int o, float v)
+{
+	Q[o] = (N[o] * Q[o] + v) / (N[o] + 1);
+	N[o]++;
+
+	float sumP = 0.0f;
+	float sumQ = 0.0f;
+	for (int i = 0; i < outcomes->size; i++)
+	{
+		if (N[i] > 0)
+		{
+			sumP += outcomes->outcome[i].probability;
+			sumQ += outcomes->outcome[i].probability * Q[i];
+		}
+	}
+	return sumQ / sumP;
+}
+
+static float gumbelSigma(float q, uint32_t maxN)
+{
+	return (GUMBEL_C_VISIT + maxN) * GUMBEL_C_SCALE * (q + 1.0f) / 2.0f; // Value is rescaled from [-1, 1] to [0, 1]
+}
+
 //////////////////////
 // StateSimulations //
 //////////////////////
-StateSimulations::StateSimulations(NNOutputData out, uint64_t vm)
+std::atomic<int64_t> StateSimulations::liveNodes = 0;
+
+StateSimulations::StateSimulations(const State& state, NNOutputData out, uint64_t vm) : state(state)
 {
+	liveNodes++;
 	value = out.value;
-	visited = true;
 	sumN = 0;
+	nodeQ = value;
 
+	moveValues.reserve(Utility::popcount(vm));
 	uint64_t tvm = vm;
 	while (tvm > 0)
 	{
@@ -37,37 +98,228 @@ StateSimulations::StateSimulations(NNOutputData out, uint64_t vm)
 
 		int i = Utility::lm2i(m);
 		LandIndex li = Utility::lm2li(m);
-		moveValues[li] = SimulationValue(out.policy[i]);
+		moveValues.push_back(SimulationValue(li, out.policy[i]));
 	}
+	std::sort(moveValues.begin(), moveValues.end(), [](const SimulationValue& a, const SimulationValue& b) { return a.move < b.move; });
 }
 
-bool StateSimulations::getVisited()
+SimulationValue& StateSimulations::getMove(LandIndex li)
 {
-	return visited;
+	auto it = std::lower_bound(moveValues.begin(), moveValues.end(), li, [](const SimulationValue& sv, LandIndex li) { return sv.move < li; });
+	if (it == moveValues.end() || it->move != li)
+	{
+		throw std::invalid_argument("Move is not valid in state");
+	}
+	return *it;
 }
 
-void StateSimulations::setVisited(bool v)
+void StateSimulations::addValue(LandIndex li, float value)
 {
-	std::lock_guard<std::mutex> guard(lock);
-	visited = v;
+	std::lock_guard<NodeLock> guard(lock);
+	getMove(li).addValue(value);
+	sumN++;
 }
 
-void StateSimulations::addValue(LandIndex li, float value)
+void StateSimulations::addChanceValue(LandIndex li, int outcome, float value)
 {
-	std::lock_guard<std::mutex> guard(lock);
-	moveValues.at(li).addValue(value);
+	std::lock_guard<NodeLock> guard(lock);
+	SimulationValue& sv = getMove(li);
+	auto cv = std::find_if(chanceValues.begin(), chanceValues.end(), [li](const auto& c) { return c.first == li; });
+	sv.Q = cv->second.addValue(outcome, value); // Edge value is expectation over outcomes, not sample mean
+	sv.addVisit();
 	sumN++;
 }
 
-const std::unordered_map<LandIndex, SimulationValue>& StateSimulations::getMoveValues()
+/*
+	Node value is average of NN value and edge values weighted by edge visits.
+	Deterministic edges take value of shared child node, so visits of transpositions reached through other parents count too.
+*/
+float StateSimulations::updateNodeQ()
+{
+	std::lock_guard<NodeLock> guard(lock);
+	float sumQ = value;
+	uint32_t n = 1;
+	for (auto& sv : moveValues)
+	{
+		if (sv.N > 0)
+		{
+			sumQ += sv.N * getEdgeQ(sv);
+			n += sv.N;
+		}
+	}
+	nodeQ = sumQ / n;
+	return nodeQ;
+}
+
+void StateSimulations::linkChild(LandIndex li, StateSimulations* child, bool flip, bool stochastic)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	SimulationValue& sv = getMove(li);
+	if (sv.stochastic || (sv.child != SimulationValue::NO_CHILD && children[sv.child].get() == child))
+	{
+		return;
+	}
+
+	size_t index = std::find_if(children.begin(), children.end(), [child](const auto& c) { return c.get() == child; }) - children.begin();
+	if (index == children.size()) // Evicted by node budget since it was added
+	{
+		return;
+	}
+	if (stochastic || sv.child != SimulationValue::NO_CHILD || index >= SimulationValue::NO_CHILD) // Dice rolled on edge, also inside of collapsed forced moves
+	{
+		sv.stochastic = true;
+		sv.child = SimulationValue::NO_CHILD;
+		return;
+	}
+	sv.child = (uint16_t)index;
+	sv.flip = flip;
+}
+
+float StateSimulations::getEdgeQ(const SimulationValue& sv)
+{
+	if (sv.child == SimulationValue::NO_CHILD || !SETTINGS.MCTS_DAG_BACKUP)
+	{
+		return sv.Q;
+	}
+	float q = children[sv.child]->nodeQ.load(std::memory_order_relaxed);
+	return sv.flip ? -q : q;
+}
+
+void StateSimulations::addRootNoise(std::default_random_engine& engine)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	if (rootNoise) // Reused root keeps noise of first search, it does not build up over moves
+	{
+		return;
+	}
+	rootNoise = true;
+	std::gamma_distribution<float> gamma(SETTINGS.DIR_NOISE_VALUE, 1.0f);
+
+	std::vector<float> noise(moveValues.size());
+	for (auto& n : noise)
+	{
+		n = gamma(engine);
+	}
+	float noiseSum = std::accumulate(noise.begin(), noise.end(), 0.0f);
+
+	for (int i = 0; i < moveValues.size() && noiseSum > 0.0f; i++)
+	{
+		moveValues[i].setP((1.0f - SETTINGS.DIR_NOISE_EPSI) * moveValues[i].getP() + SETTINGS.DIR_NOISE_EPSI * noise[i] / noiseSum);
+	}
+}
+
+void StateSimulations::addMoveVisits(std::vector<float>& visits)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	for (auto& sv : moveValues)
+	{
+		visits[Utility::li2i(sv.move)] += sv.N;
+	}
+}
+
+float StateSimulations::getMoveQ(LandIndex li)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	return getEdgeQ(getMove(li));
+}
+
+int StateSimulations::getNextChanceOutcome(LandIndex li, const BattleOutcomes& outcomes)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	auto cv = std::find_if(chanceValues.begin(), chanceValues.end(), [li](const auto& c) { return c.first == li; });
+	if (cv == chanceValues.end())
+	{
+		chanceValues.push_back(std::make_pair(li, ChanceValue()));
+		cv = chanceValues.end() - 1;
+		cv->second.outcomes = &outcomes; // Same state and move always give same outcome table
+	}
+	return cv->second.pickOutcome();
+}
+
+bool StateSimulations::addChild(const std::shared_ptr<StateSimulations>& child)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	for (auto& c : children)
+	{
+		if (c == child)
+		{
+			return false;
+		}
+	}
+	children.push_back(child);
+	return true;
+}
+
+std::vector<std::shared_ptr<StateSimulations>> StateSimulations::getChildren()
+{
+	std::lock_guard<NodeLock> guard(lock);
+	return children;
+}
+
+void StateSimulations::evictChild(StateSimulations* child)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	auto it = std::find_if(children.begin(), children.end(), [child](const auto& c) { return c.get() == child; });
+	if (it == children.end())
+	{
+		return;
+	}
+
+	uint16_t index = (uint16_t)(it - children.begin());
+	for (auto& sv : moveValues)
+	{
+		if (sv.child == index)
+		{
+			sv.Q = getEdgeQ(sv); // Aggregated value of subtree stays with edge visits
+			sv.child = SimulationValue::NO_CHILD;
+		}
+		else if (sv.child != SimulationValue::NO_CHILD && sv.child > index)
+		{
+			sv.child--;
+		}
+	}
+	children.erase(it);
+}
+
+uint32_t StateSimulations::getChildVisits(StateSimulations* child, bool& active)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	auto it = std::find_if(children.begin(), children.end(), [child](const auto& c) { return c.get() == child; });
+	uint32_t visits = 0;
+	for (auto& sv : moveValues)
+	{
+		if (sv.child != SimulationValue::NO_CHILD && children.begin() + sv.child == it)
+		{
+			visits += sv.N;
+			active = active || sv.active_N > 0;
+		}
+	}
+	return visits;
+}
+
+size_t StateSimulations::getMemoryBytes()
+{
+	std::lock_guard<NodeLock> guard(lock);
+	return sizeof(StateSimulations) + 3 * sizeof(void*) // Shared pointer control block
+		+ moveValues.capacity() * sizeof(SimulationValue)
+		+ chanceValues.capacity() * sizeof(std::pair<LandIndex, ChanceValue>)
+		+ children.capacity() * sizeof(std::shared_ptr<StateSimulations>);
+}
+
+uint32_t StateSimulations::getSumN()
+{
+	std::lock_guard<NodeLock> guard(lock);
+	return sumN;
+}
+
+const std::vector<SimulationValue>& StateSimulations::getMoveValues()
 {
 	return moveValues;
 }
 
-LandIndex StateSimulations::getNextBestMoveAndSetVisited()
+LandIndex StateSimulations::getNextBestMove()
 {
-	std::lock_guard<std::mutex> guard(lock);
-	visited = true;
+	std::lock_guard<NodeLock> guard(lock);
 
 	LandIndex bestMove = LandIndex::None;
 	float bestU = -INFINITY;
@@ -75,20 +327,27 @@ LandIndex StateSimulations::getNextBestMoveAndSetVisited()
 	LandIndex duplicateBestMove = LandIndex::None;
 	float duplicateBestU = -INFINITY;
 
-	for (auto e : moveValues)
+	float exploration = SETTINGS.HP_EXPLORATION * sqrtf(1.0f + sumN);
+	for (auto& sv : moveValues)
 	{		
-		float P = e.second.P;
-		float noiseP = (1 - SETTINGS.DIR_NOISE_EPSI) * P + SETTINGS.DIR_NOISE_EPSI * SETTINGS.DIR_NOISE_VALUE;
+		if (sv.active_N == SimulationValue::MAX_ACTIVE_N)
+		{
+			continue;
+		}
 
-		float v = noiseP * SETTINGS.HP_EXPLORATION * sqrtf(1.0f + sumN);
-		float n = 1.0f + e.second.N;
+		float P = sv.getP();
+		float noiseP = rootNoise ? P : (1 - SETTINGS.DIR_NOISE_EPSI) * P + SETTINGS.DIR_NOISE_EPSI * SETTINGS.DIR_NOISE_VALUE; // Dirichlet noise replaces constant smoothing
 
-		float u = e.second.Q + (v / n);
+		float v = noiseP * exploration;
+		float n = 1.0f + sv.N + sv.active_N;
+		float edgeQ = getEdgeQ(sv);
+		float q = sv.active_N == 0 ? edgeQ : (sv.N * edgeQ - sv.active_N * VIRTUAL_LOSS) / (sv.N + sv.active_N);
+
+		float u = q + (v / n);
 		if (u > bestU)
 		{
-			SimulationValue& sv = moveValues.at(e.first);
 			// Skip if one thread is already exploring unobserved state to avoid duplicate requests
-			if (sv.N == 0 && sv.active_N == 1) 
+			if (sv.N == 0 && sv.active_N >= 1) 
 			{
 				/* 
 				When there is none unobserved move left, duplicate move request. 
@@ -97,13 +356,13 @@ LandIndex StateSimulations::getNextBestMoveAndSetVisited()
 				if (u > duplicateBestU) 
 				{
 					duplicateBestU = u;
-					duplicateBestMove = e.first;
+					duplicateBestMove = sv.move;
 				}
 			}
 			else
 			{
 				bestU = u;
-				bestMove = e.first;
+				bestMove = sv.move;
 			}			
 		}	
 	}
@@ -113,30 +372,123 @@ LandIndex StateSimulations::getNextBestMoveAndSetVisited()
 		bestMove = duplicateBestMove;
 	}
 
-	SimulationValue& sv = moveValues.at(bestMove);
-	sv.active_N++;
+	getMove(bestMove).active_N++;
 	return bestMove;
 }
 
-std::vector<float> StateSimulations::calculateMoveProbability(float temp)
+LandIndex StateSimulations::visitMove(LandIndex li)
 {
-	std::lock_guard<std::mutex> guard(lock);
-	std::vector<float> policy(ALL_MOVES);
-	
+	std::lock_guard<NodeLock> guard(lock);
+	getMove(li).active_N++;
+	return li;
+}
+
+/*
+	Improved policy of gumbel search, unvisited moves are completed with mix of state value and visited q values.
+*/
+std::vector<float> StateSimulations::calculateImprovedPolicy()
+{
+	std::lock_guard<NodeLock> guard(lock);
+
+	float sumPQ = 0.0f;
+	float sumP = 0.0f;
+	uint32_t maxN = 0;
+	for (auto& sv : moveValues)
+	{
+		if (sv.N > 0)
+		{
+			sumPQ += sv.getP() * getEdgeQ(sv);
+			sumP += sv.getP();
+		}
+		maxN = __MAX(maxN, (uint32_t)sv.N);
+	}
+
+	float vMix = value;
+	if (sumP > 0.0f)
+	{
+		vMix = (value + sumN * sumPQ / sumP) / (1.0f + sumN);
+	}
+
+	std::vector<float> policy(ALL_MOVES, 0.0f);
+	float maxLogit = -INFINITY;
+	for (auto& sv : moveValues)
+	{
+		float q = sv.N > 0 ? getEdgeQ(sv) : vMix;
+		float logit = logf(__MAX(sv.getP(), 1e-8f)) + gumbelSigma(q, maxN);
+		policy[Utility::li2i(sv.move)] = logit;
+		maxLogit = __MAX(maxLogit, logit);
+	}
+
 	float probSum = 0.0f;
-	for (int i = 0; i < ALL_MOVES; i++)
+	for (auto& sv : moveValues)
+	{
+		int i = Utility::li2i(sv.move);
+		policy[i] = expf(policy[i] - maxLogit);
+		probSum += policy[i];
+	}
+
+	for (int i = 0; i < policy.size(); i++)
+	{
+		policy[i] /= probSum;
+	}
+
+	return policy;
+}
+
+float StateSimulations::calculatePriorEntropy()
+{
+	std::lock_guard<NodeLock> guard(lock);
+	if (moveValues.size() <= 1)
+	{
+		return 0.0f;
+	}
+
+	float entropy = 0.0f;
+	for (auto& sv : moveValues)
 	{
-		LandIndex li = Utility::i2li(i);
-		if (moveValues.contains(li))
+		float P = sv.getP();
+		if (P > 0.0f)
 		{
-			SimulationValue& sv = moveValues.at(li);
-			float prob = pow(sv.N, (1.0 / temp));
-			policy[i] = prob;
-			probSum += prob;
+			entropy -= P * logf(P);
 		}
-		else
+	}
+	return entropy / logf((float)moveValues.size());
+}
+
+float StateSimulations::calculatePriorKL(const std::vector<float>& policy)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	float kl = 0.0f;
+	for (auto& sv : moveValues)
+	{
+		float p = policy[Utility::li2i(sv.move)];
+		if (p > 0.0f)
 		{
-			policy[i] = 0.0f;
+			kl += p * logf(p / __MAX(sv.getP(), 1e-8f));
+		}
+	}
+	return kl;
+}
+
+std::vector<float> StateSimulations::calculateMoveProbability(float temp)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	std::vector<float> policy(ALL_MOVES, 0.0f);
+	
+	float probSum = 0.0f;
+	for (auto& sv : moveValues)
+	{
+		float prob = pow(sv.N, (1.0 / temp));
+		policy[Utility::li2i(sv.move)] = prob;
+		probSum += prob;
+	}
+
+	if (probSum == 0.0f) // Search stopped by deadline before any visit, use prior
+	{
+		for (auto& sv : moveValues)
+		{
+			policy[Utility::li2i(sv.move)] = sv.getP();
+			probSum += sv.getP();
 		}
 	}
 
@@ -177,202 +529,704 @@ std::vector<float> StateSimulations::calculateMoveProbability(float temp)
 	*/
 }
 
-SimulationValue& StateSimulations::getSimulatedValue(LandIndex li)
+/*
+	Leader counts only finished visits, challenger also in flight ones, so concurent simulations can not invalidate decision.
+*/
+bool StateSimulations::isDecided(int remaining)
 {
-	std::lock_guard<std::mutex> guard(lock);
-	return moveValues.at(li);
-}
+	std::lock_guard<NodeLock> guard(lock);
 
-/////////////////////////////
-// StateSimulationsStorage //
-/////////////////////////////
-bool StateSimulationsStorage::exist(const State& key)
-{
-	std::lock_guard<std::mutex> guard(lock);
-	for (auto i : state_map)
+	LandIndex leader = LandIndex::None;
+	uint32_t first = 0;
+	for (auto& sv : moveValues)
 	{
-		if (i.first.equalFields(key)) 
+		if (sv.N > first)
 		{
-			return true;
+			leader = sv.move;
+			first = sv.N;
 		}
 	}
-	return false;
-	//return state_map.contains(key);
+
+	uint32_t second = 0;
+	for (auto& sv : moveValues)
+	{
+		if (sv.move != leader)
+		{
+			second = __MAX(second, (uint32_t)(sv.N + sv.active_N));
+		}
+	}
+	return first > second + remaining;
+}
+
+SimulationValue& StateSimulations::getSimulatedValue(LandIndex li)
+{
+	std::lock_guard<NodeLock> guard(lock);
+	return getMove(li);
 }
 
-void StateSimulationsStorage::add(const State& key, std::shared_ptr<StateSimulations>& value)
+/////////////////////////////
+// StateSimulationsStorage //
+/////////////////////////////
+std::shared_ptr<StateSimulations> StateSimulationsStorage::add(const State& key, std::shared_ptr<StateSimulations>& value)
 {
 	std::lock_guard<std::mutex> guard(lock);
-	if (!state_map.contains(key))
+	std::weak_ptr<StateSimulations>& entry = state_map[key];
+
+	std::shared_ptr<StateSimulations> stored = entry.lock();
+	if (stored == nullptr)
 	{
-		state_map[key] = value;
+		entry = value;
 		statesAdded++;
+		return value;
 	}
 	else
 	{
 		duplicatedStatesDropped++;
+		return stored;
 	}
 }
 
 std::shared_ptr<StateSimulations> StateSimulationsStorage::getStateSimulation(const State& state)
 {
 	std::lock_guard<std::mutex> guard(lock);
-	return state_map.at(state);
+	auto it = state_map.find(state);
+	if (it == state_map.end())
+	{
+		return nullptr;
+	}
+	return it->second.lock();
 }
 
-void StateSimulationsStorage::clearNodes()
+std::shared_ptr<StateSimulations> StateSimulationsStorage::getRoot()
 {
 	std::lock_guard<std::mutex> guard(lock);
-	state_map.clear();
+	return root;
 }
 
-void StateSimulationsStorage::trimNodes()
+void StateSimulationsStorage::setRoot(std::shared_ptr<StateSimulations> node)
 {
 	std::lock_guard<std::mutex> guard(lock);
-	for (auto it = state_map.begin(); it != state_map.end();)
+	if (root != node)
 	{
-		StateSimulations& value = *it->second;
-		if (value.getVisited()) // Keep only visited nodes
-		{
-			value.setVisited(false);
-			++it;
-		}
-		else
+		if (root != nullptr)
 		{
-			it = state_map.erase(it);
+			detached.push_back(std::move(root)); // Subtree of new root is still owned by its parent
 		}
+		root = node;
 	}
 }
 
-#ifdef LOG_PERFORMANCE
-std::mutex logLock;
-int countPerformanceLog = 1000;
-#endif // LOG_PERFORMANCE
-
-///////////////////
-// AlphaZeroMCTS //
-///////////////////
-void AlphaZeroMCTS::simulate(const State& state, std::shared_ptr<AlphaZeroNNId> nn)
+/*
+	Free at most budget nodes, that are not reachable from root any more.
+	Node with single owner is only owned by detached list, its children are detached in turn.
+	Nodes that got reached again by search are shared and are skipped.
+*/
+int StateSimulationsStorage::reclaim(int budget)
 {
-	std::vector<std::thread> threads;
-
-#ifdef LOG_PERFORMANCE
-	auto startProcessing = std::chrono::high_resolution_clock::now();
-#endif // LOG_PERFORMANCE
+	std::lock_guard<std::mutex> guard(lock);
+	int reclaimed = 0;
+	while (reclaimed < budget && !detached.empty())
+	{
+		std::shared_ptr<StateSimulations> node = std::move(detached.back());
+		detached.pop_back();
 
-	setRootState(state, nn);
+		if (node.use_count() > 1) // Still reachable
+		{
+			continue;
+		}
 
-	int count = SETTINGS.MCTS_SIMULATIONS - (SETTINGS.MCTS_SIMULATIONS % SETTINGS.THREADS_PER_MCTS); // Make sure that count is multiple of number of threads, else it will cause deadlock at predictFuture()
-	std::shared_ptr<Counter> c(new Counter);
-	c->setCount(count);
+		for (auto& c : node->children)
+		{
+			if (c.use_count() == 1)
+			{
+				detached.push_back(std::move(c));
+			}
+		}
+		node->children.clear();
 
-	for (int i = 0; i < SETTINGS.THREADS_PER_MCTS; i++) // Spawn threads
-	{
-		threads.push_back(std::thread(&AlphaZeroMCTS::threadSimulateJob, this, state, nn, c));
-	}
-	for (int i = 0; i < SETTINGS.THREADS_PER_MCTS; i++) // Wait all threads to finish
-	{
-		threads[i].join();
-	}
+		auto it = state_map.find(node->state);
+		if (it != state_map.end() && it->second.lock() == node)
+		{
+			state_map.erase(it);
+		}
 
-#ifdef LOG_PERFORMANCE
-	auto endProcessing = std::chrono::high_resolution_clock::now();
-	if (countPerformanceLog > 0)
-	{
-		std::lock_guard guard(logLock);
-		countPerformanceLog--;
-		LOG.getMCTSPerformanceLog() << std::chrono::duration_cast<std::chrono::nanoseconds>(endProcessing - startProcessing).count() << " ns\n";
+		statesReclaimed++;
+		reclaimed++;
 	}
-#endif // LOG_PERFORMANCE
+	return reclaimed;
 }
 
-void AlphaZeroMCTS::setRootState(const State& state, std::shared_ptr<AlphaZeroNNId> nn)
+void StateSimulationsStorage::clearNodes()
 {
-	store.trimNodes();
-	if (!store.exist(state))
-	{
-		uint64_t validMoves = UtilityNN::getValidMoves(state);
-		NNOutputData out = nn->predict(NNInputData(state));
-		out.normalize(validMoves);
-
-		std::shared_ptr<StateSimulations> ss_ptr(new StateSimulations(out, validMoves));
-		store.add(state, ss_ptr);
+	setRoot(nullptr); // Whole tree is reclaimed incrementally during next searches
+}
 
-		missCouter++;
-	}
-	else
+void StateSimulationsStorage::remove(StateSimulations* node)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = state_map.find(node->state);
+	if (it != state_map.end() && it->second.lock().get() == node)
 	{
-		hitCouter++;
+		state_map.erase(it);
 	}
 }
 
+int StateSimulationsStorage::dropExpired()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return (int)std::erase_if(state_map, [](const auto& it) { return it.second.expired(); });
+}
 
-void AlphaZeroMCTS::threadSimulateJob(State state, std::shared_ptr<AlphaZeroNNId> nn, std::shared_ptr<Counter> c)
+size_t StateSimulationsStorage::size()
 {
-	nn->registerThread();
-	while (c->hasNext()) 
-	{
-		State copyState = state;
-		copyState.setLog(false);
-		search(copyState, nn);
-	}
-	nn->unregisterThread();
+	std::lock_guard<std::mutex> guard(lock);
+	return state_map.size();
 }
 
-float AlphaZeroMCTS::search(State& state, std::shared_ptr<AlphaZeroNNId> nn)
+void StateSimulationsStorage::collectStats(TreeStats& stats)
 {
-	int8_t gameStatus = state.gameStatus();
-	if (gameStatus != State::NOT_ENDED)
-	{
-		if (gameStatus == State::DRAW)
-		{
-			return 0.0f;
-		}
-		state.logGameStatus();
-		return gameStatus == state.getCurrentPlayerTurn() ? 1.0f : -1.0f;
+	std::lock_guard<std::mutex> guard(lock);
+	stats.nodesAdded += statesAdded;
+	stats.duplicateLeaves += duplicatedStatesDropped;
+	stats.nodesReclaimed += statesReclaimed;
+	stats.storedNodes = state_map.size();
+
+	statesAdded = 0;
+	duplicatedStatesDropped = 0;
+	statesReclaimed = 0;
+}
+
+///////////////
+// TreeStats //
+///////////////
+float TreeStats::getNodesPerMove() const
+{
+	return moves == 0 ? 0.0f : float(nodesAdded) / moves;
+}
+
+float TreeStats::getMeanDepth() const
+{
+	return descents == 0 ? 0.0f : float(depthSum) / descents;
+}
+
+float TreeStats::getBranchingFactor() const
+{
+	return innerNodes == 0 ? 0.0f : float(treeEdges) / innerNodes;
+}
+
+float TreeStats::getTranspositionHitRate() const
+{
+	return edgeLookups == 0 ? 0.0f : float(transpositionHits) / edgeLookups;
+}
+
+float TreeStats::getDuplicateLeafRate() const
+{
+	return descents == 0 ? 0.0f : float(duplicateLeaves) / descents;
+}
+
+float TreeStats::getReusedFraction() const
+{
+	return reusedVisits + simulations == 0 ? 0.0f : float(reusedVisits) / (reusedVisits + simulations);
+}
+
+void TreeStats::writeCSV(std::ostream& os, bool header) const
+{
+	if (header)
+	{
+		os << "moves,root_hits,root_misses,nodes_per_move,stored_nodes,tree_nodes,nodes_reclaimed,mean_depth,max_depth,branching_factor,"
+			"transposition_hit_rate,duplicate_leaf_rate,reused_fraction,memory_bytes\n";
 	}
+	os << moves << "," << rootHits << "," << rootMisses << "," << getNodesPerMove() << "," << storedNodes << "," << treeNodes << "," << nodesReclaimed << ","
+		<< getMeanDepth() << "," << maxDepth << "," << getBranchingFactor() << ","
+		<< getTranspositionHitRate() << "," << getDuplicateLeafRate() << "," << getReusedFraction() << "," << memoryBytes << std::endl;
+}
 
-	uint64_t validMoves = UtilityNN::getValidMoves(state);
-	if (validMoves == 0)
+void TreeStats::writeJSON(std::ostream& os) const
+{
+	os << "{\"moves\": " << moves << ", \"root_hits\": " << rootHits << ", \"root_misses\": " << rootMisses
+		<< ", \"nodes_per_move\": " << getNodesPerMove() << ", \"stored_nodes\": " << storedNodes << ", \"tree_nodes\": " << treeNodes << ", \"nodes_reclaimed\": " << nodesReclaimed
+		<< ", \"mean_depth\": " << getMeanDepth() << ", \"max_depth\": " << maxDepth << ", \"branching_factor\": " << getBranchingFactor()
+		<< ", \"transposition_hit_rate\": " << getTranspositionHitRate() << ", \"duplicate_leaf_rate\": " << getDuplicateLeafRate()
+		<< ", \"reused_fraction\": " << getReusedFraction() << ", \"memory_bytes\": " << memoryBytes << "}" << std::endl;
+}
+
+///////////////////
+// RootMoveQueue //
+///////////////////
+bool RootMoveQueue::hasNext(LandIndex& move)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (next >= count || std::chrono::steady_clock::now() >= deadline)
 	{
-		throw std::invalid_argument("Valid moves can not be 0");
+		return false;
+	}
+	if (root && !decided && root->isDecided(count - next))
+	{
+		decided = true;
+	}
+	if (decided)
+	{
+		return false;
 	}
 
-#ifdef _DEBUG
-	if (state.getRoundPhase() == RoundPhase::ATTACK && Utility::popcount(validMoves) <= 1) // If only one 1 automaticaly pick it no simulation
+	move = moves.empty() ? LandIndex::None : moves[next % moves.size()];
+	next++;
+	return true;
+}
+
+int RootMoveQueue::getTaken()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return next;
+}
+
+bool RootMoveQueue::isDecided()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return decided;
+}
+
+void RootMoveQueue::stop()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	count = next;
+}
+
+#ifdef LOG_PERFORMANCE
+std::mutex logLock;
+int countPerformanceLog = 1000;
+#endif // LOG_PERFORMANCE
+
+///////////////////
+// AlphaZeroMCTS //
+///////////////////
+int AlphaZeroMCTS::simulate(const State& state, std::shared_ptr<AlphaZeroNNId> nn, bool fullSearch, bool greedyMove)
+{
+#ifdef LOG_PERFORMANCE
+	auto startProcessing = std::chrono::high_resolution_clock::now();
+#endif // LOG_PERFORMANCE
+	auto start = std::chrono::steady_clock::now();
+	SearchDeadline deadline = SETTINGS.MCTS_MOVE_TIME_MS > 0 ? start + std::chrono::milliseconds(SETTINGS.MCTS_MOVE_TIME_MS) : SearchDeadline::max();
+
+	int simulations;
+	if (!ensemble.empty())
 	{
-		throw std::invalid_argument("Valid moves can not be 1 or less");
+		simulations = simulateEnsemble(state, nn, fullSearch, deadline);
 	}
-#endif // DEBUG	
+	else
+	{
+		setRootState(state, nn);
+		std::shared_ptr<StateSimulations> root = store.getRoot();
+		simulations = getSimulationBudget(state, root, fullSearch);
+
+		if (SETTINGS.MCTS_GUMBEL_ROOT)
+		{
+			simulations = simulateGumbel(state, nn, root, simulations, deadline);
+		}
+		else if (SETTINGS.MCTS_EARLY_STOP && greedyMove && simulations != INT_MAX) // Sampled move and training target need whole visit distribution
+		{
+			if (SETTINGS.MCTS_CARRY_SAVED_SIMULATIONS)
+			{
+				int carried = __MIN(savedSimulations, simulations); // At most doubles search
+				savedSimulations -= carried;
+				simulations += carried;
+			}
+
+			std::shared_ptr<RootMoveQueue> q(new RootMoveQueue(simulations, deadline, root));
+			int executed = runSimulations(state, nn, q);
+			if (q->isDecided())
+			{
+				earlyStops++;
+				savedSimulations += simulations - executed;
+			}
+			simulations = executed;
+		}
+		else
+		{
+			simulations = runSimulations(state, nn, std::shared_ptr<RootMoveQueue>(new RootMoveQueue(simulations, deadline)));
+		}
+	}
+	moveLatencies.push_back(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+	updatePeakMemory();
 
-	if (!store.exist(state))
+#ifdef LOG_PERFORMANCE
+	auto endProcessing = std::chrono::high_resolution_clock::now();
+	if (countPerformanceLog > 0)
+	{
+		std::lock_guard guard(logLock);
+		countPerformanceLog--;
+		LOG.getMCTSPerformanceLog() << std::chrono::duration_cast<std::chrono::nanoseconds>(endProcessing - startProcessing).count() << " ns\n";
+	}
+#endif // LOG_PERFORMANCE
+
+	this->simulations += simulations;
+
+	treeStats.moves++;
+	treeStats.simulations += simulations;
+	if (SETTINGS.MCTS_TREE_STATS_INTERVAL > 0 && treeStats.moves >= SETTINGS.MCTS_TREE_STATS_INTERVAL)
 	{
-		std::future<NNOutputData> fout = nn->predictFuture(NNInputData(state)); // Queue thread for prediction
-		NNOutputData out = fout.get();
+		logTreeStats();
+	}
+	return simulations;
+}
+
+/*
+	Simulations for search, fast searches are only used to pick move.
+	Setup placements and mobilization are mostly mechanical and confident prior needs less search, both halve budget.
+*/
+int AlphaZeroMCTS::getSimulationBudget(const State& state, std::shared_ptr<StateSimulations> root, bool fullSearch)
+{
+	int simulations = fullSearch ? SETTINGS.MCTS_SIMULATIONS : SETTINGS.MCTS_FAST_SIMULATIONS;
+	if (simulations <= 0 && SETTINGS.MCTS_MOVE_TIME_MS > 0) // Only deadline limits search
+	{
+		return INT_MAX;
+	}
+	if (SETTINGS.MCTS_ADAPTIVE_BUDGET)
+	{
+		RoundPhase phase = state.getRoundPhase();
+		if (phase == RoundPhase::SETUP || phase == RoundPhase::SETUP_NEUTRAL || phase == RoundPhase::ATTACK_MOBILIZATION)
+		{
+			simulations /= 2;
+		}
+		if (root->calculatePriorEntropy() < CONFIDENT_PRIOR_ENTROPY)
+		{
+			simulations /= 2;
+		}
+	}
+	return __MAX(1, simulations);
+}
+
+int AlphaZeroMCTS::runSimulations(const State& state, std::shared_ptr<AlphaZeroNNId> nn, std::shared_ptr<RootMoveQueue> q)
+{
+	int jobs = __MAX(1, SETTINGS.THREADS_PER_MCTS);
+	std::shared_ptr<std::latch> done(new std::latch(jobs));
+
+	for (int i = 0; i < jobs; i++) // Start concurent simulations on scheduler
+	{
+		simulateJob(state, nn, q, done);
+	}
+	done->wait(); // Wait all simulations to finish, in flight NN requests are drained by jobs
+	return q->getTaken();
+}
+
+/*
+	Gumbel root search, k moves are sampled without replacement by gumbel top-k trick,
+	simulations are split between them by sequential halving on gumbel + logit + sigma(q).
+	Remaining move is played, no exploration noise or temperature is needed.
+	Without simulation limit each phase gets equal share of time left till deadline.
+*/
+int AlphaZeroMCTS::simulateGumbel(const State& state, std::shared_ptr<AlphaZeroNNId> nn, std::shared_ptr<StateSimulations> root, int simulations, SearchDeadline deadline)
+{
+	class Candidate
+	{
+	public:
+		LandIndex move;
+		float gumbelLogit;
+		float score;
+	};
+
+	std::vector<Candidate> candidates;
+	for (auto& sv : root->getMoveValues())
+	{
+		float g = -logf(-logf(__MAX(RNG.rFloat(), 1e-20f)));
+		float gl = g + logf(__MAX(sv.getP(), 1e-8f));
+		candidates.push_back({ sv.move, gl, gl });
+	}
+
+	auto byScore = [](const Candidate& a, const Candidate& b) { return a.score > b.score; };
+	std::sort(candidates.begin(), candidates.end(), byScore);
+	candidates.resize(__MIN((int)candidates.size(), __MAX(1, SETTINGS.GUMBEL_SAMPLED_MOVES)));
+
+	int phases = __MAX(1, (int)ceilf(log2f((float)candidates.size())));
+	int budget = simulations;
+	int executed = 0;
+
+	for (; candidates.size() > 1 && budget > 0 && std::chrono::steady_clock::now() < deadline; phases--)
+	{
+		int visits = __MAX(1, budget / (__MAX(1, phases) * (int)candidates.size()));
+		if (candidates.size() == 2)
+		{
+			visits = __MAX(1, budget / 2); // Last phase uses rest of budget
+		}
+
+		SearchDeadline phaseDeadline = deadline;
+		if (simulations == INT_MAX)
+		{
+			phaseDeadline = std::chrono::steady_clock::now() + (deadline - std::chrono::steady_clock::now()) / __MAX(1, phases);
+		}
+
+		std::vector<LandIndex> moves;
+		for (auto& c : candidates)
+		{
+			moves.push_back(c.move); // Taken in cycle so concurent simulations spread over candidates
+		}
+		int phaseSimulations = visits * (int)moves.size();
+		int taken = runSimulations(state, nn, std::shared_ptr<RootMoveQueue>(new RootMoveQueue(std::move(moves), phaseSimulations, phaseDeadline)));
+		budget -= taken;
+		executed += taken;
+
+		uint32_t maxN = 0;
+		for (auto& sv : root->getMoveValues())
+		{
+			maxN = __MAX(maxN, (uint32_t)sv.N);
+		}
+		for (auto& c : candidates)
+		{
+			c.score = c.gumbelLogit + gumbelSigma(root->getMoveQ(c.move), maxN);
+		}
+
+		std::sort(candidates.begin(), candidates.end(), byScore);
+		candidates.resize(candidates.size() / 2);
+	}
+
+	gumbelMove = candidates[0].move;
+	return executed;
+}
+
+void AlphaZeroMCTS::setRootState(const State& state, std::shared_ptr<AlphaZeroNNId> nn, bool countSearch)
+{
+	std::shared_ptr<StateSimulations> node = store.getStateSimulation(state);
+	if (node == nullptr)
+	{
+		uint64_t validMoves = UtilityNN::getValidMoves(state);
+		NNOutputData out;
+		if (useNetwork(nn))
+		{
+			out = nn->predict(NNInputData(state));
+		}
+		evaluateHeuristic(state, out);
 		out.normalize(validMoves);
+		nnEvaluations++;
 
-		std::shared_ptr<StateSimulations> ss_ptr(new StateSimulations(out, validMoves));
-		store.add(state, ss_ptr);
-		return out.value;
+		std::shared_ptr<StateSimulations> ss_ptr(new StateSimulations(state, out, validMoves));
+		node = store.add(state, ss_ptr);
+
+		if (countSearch)
+		{
+			missCouter++;
+			treeStats.rootMisses++;
+		}
 	}
-	else
+	else if (countSearch)
+	{
+		reusedVisits += node->getSumN();
+		hitCouter++;
+		treeStats.rootHits++;
+		treeStats.reusedVisits += node->getSumN();
+	}
+
+	store.setRoot(node); // Promote subtree of played move
+	store.reclaim(NODES_RECLAIMED_PER_SIMULATION);
+	enforceNodeBudget(); // Between searches, no job holds path through tree
+}
+
+SimulationTask AlphaZeroMCTS::simulateJob(State state, std::shared_ptr<AlphaZeroNNId> nn, std::shared_ptr<RootMoveQueue> q, std::shared_ptr<std::latch> done, bool ponder)
+{
+	bool network = useNetwork(nn);
+	if (!ponder && network) // Pondering does not hold batches of searches back
+	{
+		nn->registerThread();
+	}
+	int leavesPerDescent = __MAX(1, SETTINGS.MCTS_LEAVES_PER_DESCENT);
+
+	LandIndex rootMove;
+	bool hasNext = true;
+	while (hasNext) 
+	{
+		std::vector<State> leaves; // Distinct leaves waiting for NN
+		std::vector<std::vector<SearchStep>> paths;
+		std::vector<int> pathLeaf;
+
+		int descents = 0;
+		for (; descents < leavesPerDescent && (hasNext = q->hasNext(rootMove)); descents++) // In flight visits act as virtual loss
+		{
+			State copyState = state;
+			copyState.setLog(false);
+
+			std::vector<SearchStep> path;
+			float value;
+			bool terminal = selectLeaf(copyState, path, value, rootMove);
+
+			uint32_t depth = path.size();
+			uint32_t maxDepth = treeMaxDepth;
+			while (depth > maxDepth && !treeMaxDepth.compare_exchange_weak(maxDepth, depth));
+			treeDescentDepth += depth;
+			treeDescents++;
+
+			if (terminal)
+			{
+				backup(path, value);
+				continue;
+			}
+
+			int leaf = std::find(leaves.begin(), leaves.end(), copyState) - leaves.begin();
+			if (leaf == leaves.size())
+			{
+				leaves.push_back(copyState);
+			}
+			else
+			{
+				duplicateLeaves++;
+			}
+			paths.push_back(std::move(path));
+			pathLeaf.push_back(leaf);
+		}
+
+		if (!leaves.empty())
+		{
+			std::vector<NNOutputData> outs(leaves.size());
+			if (network)
+			{
+				std::vector<NNInputData> ins;
+				for (auto& l : leaves)
+				{
+					ins.push_back(NNInputData(l));
+				}
+				outs = co_await nn->predictAsync(std::move(ins), ponder); // Suspend till batch is processed
+			}
+			for (int i = 0; i < leaves.size(); i++)
+			{
+				evaluateHeuristic(leaves[i], outs[i]);
+			}
+
+			std::vector<float> values(leaves.size());
+			for (int i = 0; i < leaves.size(); i++)
+			{
+				values[i] = expandLeaf(leaves[i], outs[i], paths[std::find(pathLeaf.begin(), pathLeaf.end(), i) - pathLeaf.begin()]);
+			}
+			for (int i = 0; i < paths.size(); i++)
+			{
+				backup(paths[i], values[pathLeaf[i]]);
+			}
+		}
+
+		store.reclaim(NODES_RECLAIMED_PER_SIMULATION * descents);
+	}
+	if (!ponder && network)
 	{
+		nn->unregisterThread();
+	}
+
+	done->count_down(); // Must be last, MCTS can be destroyed after
+}
+
+/*
+	Descend from root till unexpanded or terminal state. 
+	Returns true when value of leaf is known, otherwise leaf must be evaluated by NN.
+*/
+bool AlphaZeroMCTS::selectLeaf(State& state, std::vector<SearchStep>& path, float& value, LandIndex rootMove)
+{
+	int forcedChain = 0;
+	while (true)
+	{
+		int8_t gameStatus = state.gameStatus();
+		if (gameStatus != State::NOT_ENDED)
+		{
+			state.logGameStatus();
+			if (gameStatus == State::DRAW)
+			{
+				value = 0.0f;
+			}
+			else
+			{
+				value = gameStatus == state.getCurrentPlayerTurn() ? 1.0f : -1.0f;
+			}
+			return true;
+		}
+
+#ifdef _DEBUG
+		if (state.getRoundPhase() == RoundPhase::ATTACK && Utility::popcount(UtilityNN::getValidMoves(state)) <= 1) // If only one 1 automaticaly pick it no simulation
+		{
+			throw std::invalid_argument("Valid moves can not be 1 or less");
+		}
+#endif // DEBUG	
+
 		std::shared_ptr<StateSimulations> ss = store.getStateSimulation(state);
-		LandIndex bestMove = ss->getNextBestMoveAndSetVisited();				
+		if (ss == nullptr)
+		{
+			forcedStatesCollapsed += forcedChain;
+			return false;
+		}
 
-		int currentPlayer = state.getCurrentPlayerTurn();
-		UtilityNN::makeMove(state, bestMove); // State changed
- 		int nextMovePlayer = state.getCurrentPlayerTurn();
+		if (!path.empty())
+		{
+			const SearchStep& step = path.back();
+			edgeLookups++;
+			if (step.ss->addChild(ss)) // Link transposition reached through new parent
+			{
+				transpositionHits++;
+			}
+			step.ss->linkChild(step.move, ss.get(), step.playerChanged, step.outcome >= 0);
+		}
+
+		LandIndex bestMove = path.empty() && rootMove != LandIndex::None ? ss->visitMove(rootMove) : ss->getNextBestMove();
 
-		float newValue = search(state, nn); // State can changed
+		int8_t outcome = -1;
+		const BattleOutcome* battleOutcome = nullptr;
+		if (SETTINGS.MCTS_CHANCE_NODES && state.getRoundPhase() == RoundPhase::ATTACK && bestMove != LandIndex::Count && state.getLandArmy(bestMove).army > 0)
+		{
+			const BattleOutcomes& outcomes = state.getBattleOutcomes(UtilityNN::getAttackFrom(state, bestMove), bestMove);
+			outcome = ss->getNextChanceOutcome(bestMove, outcomes);
+			battleOutcome = &outcomes.outcome[outcome];
+		}
+		else if (diceEngine != nullptr) // Own dice stream, trees of ensemble stay independent
+		{
+			battleOutcome = UtilityNN::rollBattleOutcome(state, bestMove, *diceEngine);
+		}
 
-		if (currentPlayer != nextMovePlayer) 
+		int currentPlayer = state.getCurrentPlayerTurn();
+		UtilityNN::makeMove(state, bestMove, battleOutcome); // State changed
+		if (SETTINGS.SKIP_FORCED_MOVES)
 		{
-			newValue = -newValue; // Players change swap value
+			forcedChain += UtilityNN::makeForcedMoves(state, diceEngine.get()); // Child is next real decision, forced states are not stored
 		}
-		ss->addValue(bestMove, newValue);
+		int nextMovePlayer = state.getCurrentPlayerTurn();
+
+		path.push_back(SearchStep(ss, bestMove, currentPlayer != nextMovePlayer, outcome));
+	}
+}
+
+float AlphaZeroMCTS::expandLeaf(const State& state, NNOutputData& out, const std::vector<SearchStep>& path)
+{
+	nnEvaluations++;
+
+	uint64_t validMoves = UtilityNN::getValidMoves(state);
+	if (validMoves == 0)
+	{
+		throw std::invalid_argument("Valid moves can not be 0");
+	}
+
+	out.normalize(validMoves);
+
+	std::shared_ptr<StateSimulations> ss_ptr(new StateSimulations(state, out, validMoves));
+	std::shared_ptr<StateSimulations> stored = store.add(state, ss_ptr);
+	const SearchStep& step = path.back();
+	step.ss->addChild(stored); // Root is always expanded, leaf has parent
+	step.ss->linkChild(step.move, stored.get(), step.playerChanged, step.outcome >= 0);
 
-		return newValue;
+	return out.value;
+}
+
+void AlphaZeroMCTS::backup(const std::vector<SearchStep>& path, float value)
+{
+	for (auto it = path.rbegin(); it != path.rend(); it++)
+	{
+		if (it->playerChanged)
+		{
+			value = -value; // Players change swap value
+		}
+		if (it->outcome >= 0)
+		{
+			it->ss->addChanceValue(it->move, it->outcome, value);
+		}
+		else
+		{
+			it->ss->addValue(it->move, value);
+		}
+		if (SETTINGS.MCTS_DAG_BACKUP)
+		{
+			value = it->ss->updateNodeQ(); // Parent gets aggregated value, not only sample of this path
+		}
 	}
 }
 
@@ -411,7 +1265,466 @@ LandIndex AlphaZeroMCTS::pickHigestWeightedMove(const std::vector<float>& probs)
 	return bestLi;
 }
 
+std::vector<float> AlphaZeroMCTS::calculatePolicy(const State& state)
+{
+	if (!ensemble.empty()) // Visits of all trees are merged
+	{
+		std::vector<float> policy(ALL_MOVES, 0.0f);
+		std::shared_ptr<StateSimulations> searched;
+		for (auto& tree : ensemble)
+		{
+			std::shared_ptr<StateSimulations> ss = tree->store.getStateSimulation(state);
+			if (ss != nullptr)
+			{
+				ss->addMoveVisits(policy);
+				searched = ss;
+			}
+		}
+		if (searched == nullptr)
+		{
+			throw std::invalid_argument("State was not searched");
+		}
+
+		float probSum = std::accumulate(policy.begin(), policy.end(), 0.0f);
+		if (probSum == 0.0f)
+		{
+			return searched->calculateMoveProbability(1.0f);
+		}
+		for (auto& p : policy)
+		{
+			p /= probSum;
+		}
+		return policy;
+	}
+
+	std::shared_ptr<StateSimulations> ss = store.getStateSimulation(state);
+	if (ss == nullptr)
+	{
+		throw std::invalid_argument("State was not searched");
+	}
+	if (SETTINGS.MCTS_GUMBEL_ROOT)
+	{
+		return ss->calculateImprovedPolicy();
+	}
+	return ss->calculateMoveProbability(1.0f);
+}
+
+LandIndex AlphaZeroMCTS::pickMove(const std::vector<float>& policy, bool explore)
+{
+	if (SETTINGS.MCTS_GUMBEL_ROOT && ensemble.empty()) // Gumbel noise already sampled move
+	{
+		return gumbelMove;
+	}
+	return explore ? pickRandomWeightedMove(policy) : pickHigestWeightedMove(policy);
+}
+
 StateSimulationsStorage* AlphaZeroMCTS::getStorage()
 {
 	return &store;
 }
+
+bool AlphaZeroMCTS::skipForcedMove(State& state)
+{
+	if (SETTINGS.SKIP_FORCED_MOVES && UtilityNN::makeForcedMove(state))
+	{
+		forcedMoves++;
+		return true;
+	}
+	return false;
+}
+
+/*
+	Root parallel search, every tree gets share of budget and single job, so trees do not contend for nodes or leaves.
+	Trees differ by own dirichlet noise of root priors.
+*/
+int AlphaZeroMCTS::simulateEnsemble(const State& state, std::shared_ptr<AlphaZeroNNId> nn, bool fullSearch, SearchDeadline deadline)
+{
+	uint64_t hits = ensemble[0]->hitCouter;
+
+	std::vector<std::shared_ptr<RootMoveQueue>> queues;
+	for (auto& tree : ensemble)
+	{
+		tree->setRootState(state, nn);
+		std::shared_ptr<StateSimulations> root = tree->store.getRoot();
+		root->addRootNoise(tree->noiseEngine);
+
+		int simulations = tree->getSimulationBudget(state, root, fullSearch);
+		if (simulations != INT_MAX)
+		{
+			simulations = __MAX(1, simulations / (int)ensemble.size());
+		}
+		queues.push_back(std::shared_ptr<RootMoveQueue>(new RootMoveQueue(simulations, deadline)));
+	}
+
+	std::shared_ptr<std::latch> done(new std::latch(ensemble.size()));
+	for (int i = 0; i < ensemble.size(); i++)
+	{
+		ensemble[i]->simulateJob(state, nn, queues[i], done);
+	}
+	done->wait();
+
+	int simulations = 0;
+	for (int i = 0; i < ensemble.size(); i++)
+	{
+		simulations += queues[i]->getTaken();
+		reusedVisits += ensemble[i]->reusedVisits;
+		nnEvaluations += ensemble[i]->nnEvaluations.exchange(0);
+		ensemble[i]->reusedVisits = 0;
+	}
+	if (ensemble[0]->hitCouter > hits)
+	{
+		hitCouter++;
+	}
+	else
+	{
+		missCouter++;
+	}
+	return simulations;
+}
+
+/*
+	Runs before search when root is set, so search can exceed budget by nodes it adds.
+	Detached nodes are freed first, then leaves of tree reachable from root with least visited parent edge are evicted.
+	Leaf with visit in flight through its edge is kept, its NN evaluation is not backed up yet.
+	Process budget is shared by trees in proportion to their size.
+*/
+void AlphaZeroMCTS::enforceNodeBudget()
+{
+	int64_t treeBudget = SETTINGS.MCTS_TREE_NODE_BUDGET;
+	int64_t processBudget = SETTINGS.MCTS_PROCESS_NODE_BUDGET;
+	if ((treeBudget <= 0 || (int64_t)store.size() <= treeBudget) && (processBudget <= 0 || StateSimulations::liveNodes <= processBudget))
+	{
+		return;
+	}
+
+	store.reclaim(INT_MAX);
+	store.dropExpired();
+	int64_t size = store.size();
+	int64_t excess = 0;
+	if (treeBudget > 0 && size > treeBudget)
+	{
+		excess = size - treeBudget + treeBudget / NODE_BUDGET_SLACK;
+	}
+	int64_t live = StateSimulations::liveNodes;
+	if (processBudget > 0 && live > processBudget)
+	{
+		excess = __MAX(excess, (live - processBudget + processBudget / NODE_BUDGET_SLACK) * size / live);
+	}
+
+	std::shared_ptr<StateSimulations> root = store.getRoot();
+	if (excess > 0 && root != nullptr)
+	{
+		std::unordered_map<StateSimulations*, std::vector<StateSimulations*>> parents;
+		std::vector<std::pair<uint32_t, std::shared_ptr<StateSimulations>>> leaves; // Visits of parent edges
+		std::vector<std::shared_ptr<StateSimulations>> open = { root };
+		parents[root.get()];
+		while (!open.empty())
+		{
+			std::shared_ptr<StateSimulations> node = std::move(open.back());
+			open.pop_back();
+
+			std::vector<std::shared_ptr<StateSimulations>> children = node->getChildren();
+			if (children.empty() && node != root)
+			{
+				leaves.push_back({ 0, node });
+			}
+			for (auto& c : children)
+			{
+				auto it = parents.find(c.get());
+				if (it == parents.end())
+				{
+					parents[c.get()].push_back(node.get());
+					open.push_back(std::move(c));
+				}
+				else
+				{
+					it->second.push_back(node.get());
+				}
+			}
+		}
+
+		std::erase_if(leaves, [&parents](auto& leaf)
+		{
+			bool active = false;
+			leaf.first = leaf.second->getSumN() + 1; // Expansion visit, child of stochastic edge is not linked to edge
+			for (StateSimulations* parent : parents[leaf.second.get()])
+			{
+				leaf.first = __MAX(leaf.first, parent->getChildVisits(leaf.second.get(), active));
+			}
+			return active;
+		});
+
+		int64_t evict = __MIN(excess, (int64_t)leaves.size());
+		std::partial_sort(leaves.begin(), leaves.begin() + evict, leaves.end(), [](auto& a, auto& b) { return a.first < b.first; });
+		for (int64_t i = 0; i < evict; i++)
+		{
+			for (StateSimulations* parent : parents[leaves[i].second.get()])
+			{
+				parent->evictChild(leaves[i].second.get());
+			}
+			store.remove(leaves[i].second.get());
+		}
+		evictedNodes += evict;
+	}
+}
+
+void AlphaZeroMCTS::updatePeakMemory()
+{
+	if (SETTINGS.MCTS_TREE_NODE_BUDGET <= 0 && SETTINGS.MCTS_PROCESS_NODE_BUDGET <= 0 && SETTINGS.MCTS_TREE_STATS_INTERVAL <= 0) // Tree walk is paid only when memory is watched
+	{
+		return;
+	}
+	if (!ensemble.empty()) // Trees of ensemble are held at once, game peak is sum of their peaks
+	{
+		peakNodes = 0;
+		peakBytes = 0;
+		evictedNodes = 0;
+		for (auto& tree : ensemble)
+		{
+			tree->updatePeakMemory();
+			peakNodes += tree->peakNodes;
+			peakBytes += tree->peakBytes;
+			evictedNodes += tree->evictedNodes;
+		}
+		return;
+	}
+
+	std::shared_ptr<StateSimulations> root = store.getRoot();
+	if (store.size() <= peakNodes || root == nullptr) // Walk only when tree may have grown
+	{
+		return;
+	}
+
+	uint64_t bytes = 0;
+	std::unordered_set<StateSimulations*> visited = { root.get() };
+	std::vector<std::shared_ptr<StateSimulations>> open = { root };
+	while (!open.empty())
+	{
+		std::shared_ptr<StateSimulations> node = std::move(open.back());
+		open.pop_back();
+		bytes += node->getMemoryBytes();
+		for (auto& c : node->getChildren())
+		{
+			if (visited.insert(c.get()).second)
+			{
+				open.push_back(std::move(c));
+			}
+		}
+	}
+	peakNodes = __MAX(peakNodes, visited.size());
+	peakBytes = __MAX(peakBytes, bytes);
+}
+
+void AlphaZeroMCTS::setRootTrees(int trees)
+{
+	ensemble.clear();
+	for (int i = 0; trees > 1 && i < trees; i++)
+	{
+		ensemble.push_back(std::unique_ptr<AlphaZeroMCTS>(new AlphaZeroMCTS()));
+		ensemble.back()->noiseEngine.seed(RNG.rInt());
+		ensemble.back()->diceEngine.reset(new std::default_random_engine(RNG.rInt()));
+	}
+}
+
+void AlphaZeroMCTS::setLeafEvaluator(std::shared_ptr<LeafEvaluator> evaluator, float nnWeight)
+{
+	this->evaluator = evaluator;
+	this->nnWeight = nnWeight;
+	for (auto& tree : ensemble)
+	{
+		tree->setLeafEvaluator(evaluator, nnWeight);
+	}
+}
+
+void AlphaZeroMCTS::evaluateHeuristic(const State& state, NNOutputData& out)
+{
+	if (evaluator == nullptr)
+	{
+		return;
+	}
+
+	NNOutputData heuristic = evaluator->evaluate(state);
+	if (out.policy.empty()) // Not evaluated by NN
+	{
+		out = std::move(heuristic);
+		return;
+	}
+
+	out.normalize(UtilityNN::getValidMoves(state)); // Same scale as heuristic prior
+	for (int i = 0; i < out.policy.size(); i++)
+	{
+		out.policy[i] = nnWeight * out.policy[i] + (1.0f - nnWeight) * heuristic.policy[i];
+	}
+	out.value = nnWeight * out.value + (1.0f - nnWeight) * heuristic.value;
+}
+
+void AlphaZeroMCTS::clearNodes()
+{
+	store.clearNodes();
+	for (auto& tree : ensemble)
+	{
+		tree->store.clearNodes();
+	}
+}
+
+/*
+	Opponent moves are searched with same PUCT, subtree of played reply is promoted by next search through transposition index.
+	Pondering is capped at PONDER_SIMULATION_FACTOR searches so tree does not grow without limit while opponent thinks.
+*/
+void AlphaZeroMCTS::startPondering(const State& state, std::shared_ptr<AlphaZeroNNId> nn)
+{
+	stopPondering();
+	if (state.gameStatus() != State::NOT_ENDED || !ensemble.empty()) // Root parallel trees do not ponder
+	{
+		return;
+	}
+
+	setRootState(state, nn, false);
+	int simulations = SETTINGS.MCTS_SIMULATIONS > 0 ? PONDER_SIMULATION_FACTOR * SETTINGS.MCTS_SIMULATIONS : INT_MAX;
+	ponderQueue = std::shared_ptr<RootMoveQueue>(new RootMoveQueue(simulations, SearchDeadline::max()));
+
+	int jobs = __MAX(1, SETTINGS.THREADS_PER_MCTS / 2);
+	ponderDone = std::shared_ptr<std::latch>(new std::latch(jobs));
+	for (int i = 0; i < jobs; i++)
+	{
+		simulateJob(state, nn, ponderQueue, ponderDone, true);
+	}
+}
+
+int AlphaZeroMCTS::stopPondering()
+{
+	if (ponderQueue == nullptr)
+	{
+		return 0;
+	}
+
+	ponderQueue->stop();
+	ponderDone->wait(); // In flight low priority requests are processed with searches of other games or alone on idle network
+	int simulations = ponderQueue->getTaken();
+	ponderSimulations += simulations;
+
+	ponderQueue = nullptr;
+	ponderDone = nullptr;
+	return simulations;
+}
+
+std::mutex treeLogLock;
+
+/*
+	Walk of tree reachable from root, nodes reached by several parents are counted once.
+*/
+TreeStats AlphaZeroMCTS::getTreeStats()
+{
+	TreeStats stats = treeStats;
+	store.collectStats(stats);
+	stats.descents = treeDescents;
+	stats.depthSum = treeDescentDepth;
+	stats.maxDepth = treeMaxDepth;
+	stats.edgeLookups = edgeLookups;
+	stats.transpositionHits = transpositionHits;
+	stats.duplicateLeaves += duplicateLeaves;
+
+	std::shared_ptr<StateSimulations> root = store.getRoot();
+	if (root != nullptr)
+	{
+		std::unordered_set<StateSimulations*> visited = { root.get() };
+		std::vector<std::shared_ptr<StateSimulations>> open = { root };
+		while (!open.empty())
+		{
+			std::shared_ptr<StateSimulations> node = std::move(open.back());
+			open.pop_back();
+
+			std::vector<std::shared_ptr<StateSimulations>> children = node->getChildren();
+			stats.treeNodes++;
+			stats.memoryBytes += node->getMemoryBytes();
+			stats.treeEdges += children.size();
+			if (!children.empty())
+			{
+				stats.innerNodes++;
+			}
+
+			for (auto& c : children)
+			{
+				if (visited.insert(c.get()).second)
+				{
+					open.push_back(std::move(c));
+				}
+			}
+		}
+	}
+	return stats;
+}
+
+void AlphaZeroMCTS::logTreeStats()
+{
+	TreeStats stats = getTreeStats();
+	{
+		std::lock_guard guard(treeLogLock);
+		if (SETTINGS.MCTS_TREE_STATS_JSON)
+		{
+			stats.writeJSON(LOG.getMCTSTreeStatsLog(true));
+		}
+		else
+		{
+			std::ofstream& log = LOG.getMCTSTreeStatsLog(false);
+			stats.writeCSV(log, log.tellp() == 0);
+		}
+	}
+
+	treeStats = TreeStats();
+	treeDescents = 0;
+	treeDescentDepth = 0;
+	treeMaxDepth = 0;
+	edgeLookups = 0;
+	transpositionHits = 0;
+	duplicateLeaves = 0;
+}
+
+void AlphaZeroMCTS::logGameStats()
+{
+	uint64_t searches = hitCouter + missCouter;
+	if (searches > 0)
+	{
+		uint64_t forcedSaved = forcedMoves * nnEvaluations / searches + forcedStatesCollapsed; // Skipped searches estimated by avg. search cost
+
+		std::lock_guard guard(treeLogLock);
+		LOG.getMCTSTreeLog() << searches << ", " // Moves searched
+			<< reusedVisits << ", " << float(reusedVisits) / searches << ", " // Reused visits, per move
+			<< nnEvaluations << ", " << simulations + searches << ", " // NN evaluations, without reuse
+			<< forcedMoves << ", " << forcedSaved << ", " // Forced moves played without search, NN evaluations saved
+			<< earlyStops << ", " // Searches stopped once best move was decided
+			<< ponderSimulations << ", " // Simulations run during opponent turns
+			<< peakNodes << ", " << peakBytes / 1024 << ", " << evictedNodes << std::endl; // Largest tree of game, its size in KB, 0 when not watched, nodes evicted by budget
+	}
+
+	if (!moveLatencies.empty())
+	{
+		std::sort(moveLatencies.begin(), moveLatencies.end());
+		auto percentile = [&](float p) { return moveLatencies[(size_t)(p * (moveLatencies.size() - 1))]; };
+
+		std::lock_guard guard(treeLogLock);
+		LOG.getMCTSLatencyLog() << moveLatencies.size() << ", " << float(simulations) / moveLatencies.size() << ", " // Moves searched, avg. simulations per move
+			<< percentile(0.5f) << ", " << percentile(0.9f) << ", " << percentile(0.99f) << ", " << moveLatencies.back() << std::endl; // Latency percentiles p50, p90, p99, max in ms
+	}
+	moveLatencies.clear();
+
+	hitCouter = 0;
+	missCouter = 0;
+	reusedVisits = 0;
+	nnEvaluations = 0;
+	simulations = 0;
+	forcedMoves = 0;
+	forcedStatesCollapsed = 0;
+	earlyStops = 0;
+	savedSimulations = 0;
+	ponderSimulations = 0;
+	peakNodes = 0;
+	peakBytes = 0;
+	evictedNodes = 0;
+	for (auto& tree : ensemble)
+	{
+		tree->peakNodes = 0;
+		tree->peakBytes = 0;
+		tree->evictedNodes = 0;
+	}
+}
@@ -1,74 +1,280 @@
 #pragma once
 
 #include "alphazero_moves.h"
+#include "alphazero_evaluator.h"
 #include "neural_network/alphazero_gpu_cluster.h"
 
 #include <math.h>
 #include <stdint.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <numeric>
 #include <algorithm>
 #include <chrono>
+#include <climits>
+#include <latch>
+#include <atomic>
+#include <random>
+#include <bit>
+#include <thread>
+#include <ostream>
 
 
 static const int ALL_MOVES = DATA_TERRITORY + 1;
+static const int NODES_RECLAIMED_PER_SIMULATION = 4; // Must be greater than 1 to keep up with expanded nodes
+static const float VIRTUAL_LOSS = 1.0f; // Value assumed for in flight simulations, spreads concurent descents over tree
+static const float CONFIDENT_PRIOR_ENTROPY = 0.5f; // Normalized prior entropy, bellow it simulations are halved
+static const float GUMBEL_C_VISIT = 50.0f; // Gumbel q value scaling, sigma(q) = (c_visit + max N) * c_scale * q
+static const float GUMBEL_C_SCALE = 1.0f;
+static const int PONDER_SIMULATION_FACTOR = 4; // Pondering stops after this many searches worth of simulations
+static const int NODE_BUDGET_SLACK = 10; // Eviction frees 1/n of budget more than needed, so it does not run every search
 
+class StateSimulations;
+
+/*
+	Edge of search tree packed to 16 bytes, prior is stored as bfloat16.
+	Visits saturate at 24 bits, in flight visits are bounded by THREADS_PER_MCTS * MCTS_LEAVES_PER_DESCENT, capped to MCTS_MAX_ACTIVE_DESCENTS in settings.
+*/
 class SimulationValue
 {
 public:
-	float Q;
-	float P;
-	uint32_t N;
-	uint8_t active_N;
+	float Q; // Mean of values backed up through edge
+	uint32_t N : 24; // Edge visits, child node can have more from other parents
+	uint32_t active_N : 8;
+	uint16_t bf16P;
+	uint16_t child; // Index of child node of deterministic edge in children of parent
+	LandIndex move;
+	bool flip : 1; // Child node value is from other player perspective
+	bool stochastic : 1; // Edge reached different child nodes, only edge Q is used
+
+	static const uint32_t MAX_N = (1 << 24) - 1;
+	static const uint32_t MAX_ACTIVE_N = (1 << 8) - 1;
+	static const uint16_t NO_CHILD = UINT16_MAX;
 
 	void addValue(float v);
+	void addVisit();
+
+	float getP() const
+	{
+		return std::bit_cast<float>((uint32_t)bf16P << 16);
+	}
+
+	void setP(float p)
+	{
+		uint32_t bits = std::bit_cast<uint32_t>(p);
+		bf16P = (uint16_t)((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16); // Round to nearest even
+	}
 
-	SimulationValue() : Q(0.0f), N(0), P(0.0f), active_N(0) {};
-	SimulationValue(float p) : Q(0.0f), N(0), P(p), active_N(0) {};
+	SimulationValue(LandIndex move, float p) : Q(0.0f), N(0), active_N(0), child(NO_CHILD), move(move), flip(false), stochastic(false)
+	{
+		setP(p);
+	};
 };
+static_assert(sizeof(SimulationValue) == 16, "Edge is packed to 16 bytes");
+static_assert(SimulationValue::MAX_ACTIVE_N >= MCTS_MAX_ACTIVE_DESCENTS, "In flight visits of edge must not saturate");
+
+
+/*
+	Spin lock of node, critical sections are short and std::mutex would be larger than rest of node header.
+*/
+class NodeLock
+{
+private:
+	std::atomic_flag flag = ATOMIC_FLAG_INIT;
 
+public:
+	void lock()
+	{
+		while (flag.test_and_set(std::memory_order_acquire))
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	void unlock()
+	{
+		flag.clear(std::memory_order_release);
+	}
+};
+
+
+/*
+	Chance node after attack move, dice result is not rolled but one of exact battle outcomes is picked.
+	Outcomes are picked deterministically in proportion to their probability, so visit counts follow true distribution.
+*/
+class ChanceValue
+{
+public:
+	const BattleOutcomes* outcomes = nullptr;
+	float Q[3] = {};
+	uint32_t N[3] = {};
+	uint32_t picked[3] = {}; // Visits including in flight simulations
 
+	int pickOutcome();
+	float addValue(int outcome, float v); // Returns probability weighted value of observed outcomes
+};
+
+
+/*
+	Node budget is sizeof(StateSimulations) of 272 bytes, 176 of it is state, with 16 bytes per valid move and 16 bytes per expanded child.
+	Chance values take 56 bytes per attack move searched with chance nodes.
+*/
 class StateSimulations // Thread safe class
 {
 private:	
-	std::mutex lock;
-	std::unordered_map<LandIndex, SimulationValue> moveValues;	
+	NodeLock lock;
+	bool rootNoise = false; // Priors were mixed with dirichlet noise instead of constant smoothing, fits padding after lock
+	std::vector<SimulationValue> moveValues; // Sorted by move
+	std::vector<std::pair<LandIndex, ChanceValue>> chanceValues;
+	std::vector<std::shared_ptr<StateSimulations>> children; // Owns expanded child states, subtree is alive while reachable from root
 
 	float value;
-	bool visited;
 	uint32_t sumN;
+	std::atomic<float> nodeQ; // Value of NN and all edges, read by parents without lock
+
+	SimulationValue& getMove(LandIndex li);
+	float getEdgeQ(const SimulationValue& sv); // Value of child node when edge is deterministic and DAG backup is on
+
+	friend class StateSimulationsStorage;
 
 public:
-	StateSimulations(NNOutputData out, uint64_t validMoves);
+	const State state;
+
+	static std::atomic<int64_t> liveNodes; // Nodes of all trees in process
+
+	StateSimulations(const State& state, NNOutputData out, uint64_t validMoves);
+	~StateSimulations() { liveNodes--; };
 
 	SimulationValue& getSimulatedValue(LandIndex li);
 
-	void setVisited(bool v);
-	bool getVisited();
 	void addValue(LandIndex li, float value);
-	const std::unordered_map<LandIndex, SimulationValue>& getMoveValues();
+	void addChanceValue(LandIndex li, int outcome, float value);
+	float updateNodeQ(); // Recomputes node value from its edges, returns it
+	void linkChild(LandIndex li, StateSimulations* child, bool flip, bool stochastic);
+	float getMoveQ(LandIndex li);
+	void addRootNoise(std::default_random_engine& engine); // Mixes dirichlet noise into priors, only once per node
+	void addMoveVisits(std::vector<float>& visits);
+	bool addChild(const std::shared_ptr<StateSimulations>& child); // Returns false when child was already linked
+	std::vector<std::shared_ptr<StateSimulations>> getChildren();
+	void evictChild(StateSimulations* child); // Child value is folded into edge Q, edge is expanded again when searched
+	uint32_t getChildVisits(StateSimulations* child, bool& active); // Visits of edges linked to child, active when edge has visit in flight
+	size_t getMemoryBytes(); // Estimate of node size with its maps
+	uint32_t getSumN();
+	const std::vector<SimulationValue>& getMoveValues();
 
-	LandIndex getNextBestMoveAndSetVisited();
+	LandIndex getNextBestMove();
+	LandIndex visitMove(LandIndex li); // Move forced by root search
+	int getNextChanceOutcome(LandIndex li, const BattleOutcomes& outcomes);
 	std::vector<float> calculateMoveProbability(float temp);	
+	std::vector<float> calculateImprovedPolicy(); // Softmax of prior logits and completed q values
+	float calculatePriorEntropy(); // Normalized to [0, 1]
+	float calculatePriorKL(const std::vector<float>& policy); // How far search moved policy from prior
+	bool isDecided(int remaining); // Most visited move can not be overtaken by remaining simulations
 };
 
 
+class TreeStats
+{
+public:
+	uint64_t moves = 0; // Searched moves since last report
+	uint64_t rootHits = 0; // Root found in tree
+	uint64_t rootMisses = 0;
+	uint64_t reusedVisits = 0;
+	uint64_t simulations = 0;
+
+	uint64_t nodesAdded = 0;
+	uint64_t nodesReclaimed = 0;
+	uint64_t storedNodes = 0; // Nodes in transposition index, detached ones not reclaimed yet included
+	uint64_t treeNodes = 0; // Nodes reachable from root
+	uint64_t innerNodes = 0; // Reachable nodes with expanded child
+	uint64_t treeEdges = 0;
+	uint64_t memoryBytes = 0; // Estimated size of reachable nodes
+
+	uint64_t descents = 0;
+	uint64_t depthSum = 0;
+	uint32_t maxDepth = 0;
+	uint64_t edgeLookups = 0; // Stored nodes reached during selection below root
+	uint64_t transpositionHits = 0; // Stored nodes reached through parent not linked to them yet
+	uint64_t duplicateLeaves = 0; // Leaves already expanded or requested by concurent descent
+
+	float getNodesPerMove() const;
+	float getMeanDepth() const;
+	float getBranchingFactor() const;
+	float getTranspositionHitRate() const;
+	float getDuplicateLeafRate() const;
+	float getReusedFraction() const;
+
+	void writeCSV(std::ostream& os, bool header) const;
+	void writeJSON(std::ostream& os) const; // Single line object
+};
+
+
+/*
+	Nodes are owned by their parents and current root, map is only transposition index.
+	When root is promoted, old root is detached and nodes no longer reachable from new root are freed incrementally by reclaim().
+	Detached nodes stay in index until freed, so they are reused if search reaches them again.
+*/
 class StateSimulationsStorage // Thread safe class
 {
 private:
 	std::mutex lock;
-	std::unordered_map<State, std::shared_ptr<StateSimulations>> state_map;
+	std::unordered_map<State, std::weak_ptr<StateSimulations>> state_map;
+	std::shared_ptr<StateSimulations> root;
+	std::vector<std::shared_ptr<StateSimulations>> detached;
 
 	uint64_t statesAdded = 0;
 	uint64_t duplicatedStatesDropped = 0;
+	uint64_t statesReclaimed = 0;
 public:
-	std::shared_ptr<StateSimulations> getStateSimulation(const State& state);
+	std::shared_ptr<StateSimulations> getStateSimulation(const State& state); // Returns nullptr when state is not stored
+	std::shared_ptr<StateSimulations> add(const State& key, std::shared_ptr<StateSimulations>& value); // Returns stored node, existing one on duplicate
 
-	bool exist(const State& state);
-	void add(const State& key, std::shared_ptr<StateSimulations>& value);
+	std::shared_ptr<StateSimulations> getRoot();
+	void setRoot(std::shared_ptr<StateSimulations> node);
 
-	void trimNodes();
+	int reclaim(int budget);
 	void clearNodes();
+	void remove(StateSimulations* node); // Drops node from index, it is freed with last owner
+	int dropExpired(); // Index entries of nodes freed outside of reclaim
+	size_t size();
+
+	void collectStats(TreeStats& stats); // Adds counters since last call
+};
+
+
+class SearchStep // Edge taken during selection, used for value backup
+{
+public:
+	std::shared_ptr<StateSimulations> ss;
+	LandIndex move;
+	bool playerChanged;
+	int8_t outcome; // Picked battle outcome, -1 when move is not chance node
+
+	SearchStep(std::shared_ptr<StateSimulations> ss, LandIndex move, bool playerChanged, int8_t outcome = -1) : ss(ss), move(move), playerChanged(playerChanged), outcome(outcome) {};
+};
+
+
+typedef std::chrono::steady_clock::time_point SearchDeadline;
+
+class RootMoveQueue // Thread safe class
+{
+private:
+	std::mutex lock;
+	std::vector<LandIndex> moves; // Root moves taken in cycle, empty leaves root move selection to PUCT
+	int count;
+	int next = 0;
+	SearchDeadline deadline; // Simulations are not started after deadline, started ones are finished
+	std::shared_ptr<StateSimulations> root; // Set when search stops once root is decided
+	bool decided = false;
+
+public:
+	RootMoveQueue(int simulations, SearchDeadline deadline, std::shared_ptr<StateSimulations> root = nullptr) : count(simulations), deadline(deadline), root(root) {};
+	RootMoveQueue(std::vector<LandIndex> moves, int simulations, SearchDeadline deadline) : moves(std::move(moves)), count(simulations), deadline(deadline) {};
+
+	bool hasNext(LandIndex& move);
+	int getTaken();
+	bool isDecided();
+	void stop(); // No more simulations are started
 };
 
 
@@ -76,20 +282,76 @@ class AlphaZeroMCTS
 {
 private:	
 	StateSimulationsStorage store;
+	LandIndex gumbelMove = LandIndex::None; // Move left after sequential halving of last search
+
+	std::vector<std::unique_ptr<AlphaZeroMCTS>> ensemble; // Private trees of root parallel search, empty for tree parallel search
+	std::default_random_engine noiseEngine; // Root noise of ensemble tree
+	std::unique_ptr<std::default_random_engine> diceEngine; // Attack dice of ensemble tree, its single job is only user, nullptr rolls global RNG
 
-	float search(State& state, std::shared_ptr<AlphaZeroNNId> nn);
-	void threadSimulateJob(State state, std::shared_ptr<AlphaZeroNNId> nn, std::shared_ptr<Counter> c);
-	void setRootState(const State& state, std::shared_ptr<AlphaZeroNNId> nn);
+	std::shared_ptr<LeafEvaluator> evaluator;
+	float nnWeight = 1.0f; // Share of NN in leaf evaluation, rest is evaluator
+	std::shared_ptr<RootMoveQueue> ponderQueue; // Set while pondering
+	std::shared_ptr<std::latch> ponderDone;
+
+	bool selectLeaf(State& state, std::vector<SearchStep>& path, float& value, LandIndex rootMove);
+	float expandLeaf(const State& state, NNOutputData& out, const std::vector<SearchStep>& path);
+	void backup(const std::vector<SearchStep>& path, float value);
+
+	int runSimulations(const State& state, std::shared_ptr<AlphaZeroNNId> nn, std::shared_ptr<RootMoveQueue> q); // Returns simulations started
+	SimulationTask simulateJob(State state, std::shared_ptr<AlphaZeroNNId> nn, std::shared_ptr<RootMoveQueue> q, std::shared_ptr<std::latch> done, bool ponder = false);
+	int simulateGumbel(const State& state, std::shared_ptr<AlphaZeroNNId> nn, std::shared_ptr<StateSimulations> root, int simulations, SearchDeadline deadline);
+	int getSimulationBudget(const State& state, std::shared_ptr<StateSimulations> root, bool fullSearch);
+	int simulateEnsemble(const State& state, std::shared_ptr<AlphaZeroNNId> nn, bool fullSearch, SearchDeadline deadline);
+	void enforceNodeBudget();
+	bool useNetwork(const std::shared_ptr<AlphaZeroNNId>& nn) { return nn != nullptr && nnWeight > 0.0f; };
+	void evaluateHeuristic(const State& state, NNOutputData& out); // Blends evaluator into NN output, empty output is replaced
+	void updatePeakMemory();
+	void logTreeStats();
+	void setRootState(const State& state, std::shared_ptr<AlphaZeroNNId> nn, bool countSearch = true);
 
 public:
 	AlphaZeroMCTS() {};
+	~AlphaZeroMCTS() { stopPondering(); };
 
-	void simulate(const State& state, std::shared_ptr<AlphaZeroNNId> nn);
+	int simulate(const State& state, std::shared_ptr<AlphaZeroNNId> nn, bool fullSearch = true, bool greedyMove = false); // Returns simulations run, stops at SETTINGS.MCTS_MOVE_TIME_MS when set, greedy move is most visited and not recorded so early stop may cut search
+	void setRootTrees(int trees); // 1 is tree parallel search, more is root parallel search with single job per private tree
+	void setLeafEvaluator(std::shared_ptr<LeafEvaluator> evaluator, float nnWeight); // Weight 0 searches without NN
+	void clearNodes();
 	
 	StateSimulationsStorage* getStorage();
 	LandIndex pickRandomWeightedMove(const std::vector<float>& probs);
 	LandIndex pickHigestWeightedMove(const std::vector<float>& probs);
 
+	std::vector<float> calculatePolicy(const State& state); // Training target of last search
+	LandIndex pickMove(const std::vector<float>& policy, bool explore);
+
+	bool skipForcedMove(State& state); // Plays single option move without search
+
+	void startPondering(const State& state, std::shared_ptr<AlphaZeroNNId> nn); // Searches opponent position in background, state must not be player turn
+	int stopPondering(); // Waits for started simulations, returns simulations run
+	void logGameStats(); // Write tree reuse stats of played game and reset them
+	TreeStats getTreeStats(); // Counters since last tree stats report with walk of current tree
+
 	uint64_t hitCouter = 0;
 	uint64_t missCouter = 0;
+	uint64_t reusedVisits = 0; // Visits of promoted roots, simulations not needed to be repeated
+	uint64_t simulations = 0;
+	int savedSimulations = 0; // Simulations left by early stopped searches, added to next search when enabled
+	uint64_t earlyStops = 0;
+	uint64_t ponderSimulations = 0;
+	uint64_t peakNodes = 0; // Largest tree of game, walked only with node budget or tree stats
+	uint64_t peakBytes = 0;
+	std::atomic<uint64_t> evictedNodes = 0;
+	std::vector<float> moveLatencies; // Search time of each move in ms
+	uint64_t forcedMoves = 0; // Searches skipped, position had single valid move
+	std::atomic<uint64_t> forcedStatesCollapsed = 0; // Single option states skipped on way to expanded leaf, each would need NN evaluation
+	std::atomic<uint64_t> nnEvaluations = 0;
+
+	TreeStats treeStats; // Counters of single threaded search steps since last tree stats report
+	std::atomic<uint64_t> treeDescents = 0;
+	std::atomic<uint64_t> treeDescentDepth = 0;
+	std::atomic<uint32_t> treeMaxDepth = 0;
+	std::atomic<uint64_t> edgeLookups = 0;
+	std::atomic<uint64_t> transpositionHits = 0;
+	std::atomic<uint64_t> duplicateLeaves = 0;
 };
\ No newline at end of file
@@ -69,7 +69,32 @@ uint64_t UtilityNN::getValidMoves(const State& state)
 	}
 }
 
-void UtilityNN::makeMove(State& state, LandIndex li)
+LandIndex UtilityNN::getAttackFrom(const State& state, LandIndex li)
+{
+	const PlayerStatus* pls = state.getCurrentPlayerStatus();
+	const Land* l = Land::getLand(li);
+
+	land_army_t bestArmy = 0;
+	LandIndex bestAttackFrom = LandIndex::None;
+
+	for (int i = 0; i < l->neihboursLandIndex.size(); i++)
+	{
+		const Land* nl = Land::getLand(l->neihboursLandIndex[i]);
+		if ((nl->landIndexBitMask & pls->ownedLandsWithArmy) > 0)
+		{
+			land_army_t attackArmy = state.getLandArmy(nl->landIndex).army - 1;
+			if (attackArmy > bestArmy)
+			{
+				bestArmy = attackArmy;
+				bestAttackFrom = nl->landIndex;
+			}
+		}
+	}
+
+	return bestAttackFrom;
+}
+
+void UtilityNN::makeMove(State& state, LandIndex li, const BattleOutcome* outcome)
 {
 	if (li == LandIndex::None)
 	{
@@ -121,27 +146,7 @@ void UtilityNN::makeMove(State& state, LandIndex li)
 		}
 		else if (state.getRoundPhase() == RoundPhase::ATTACK) // Attacking land
 		{
-			const Land* l = Land::getLand(li);
-			bool occupiedTerritory = false;
-
-			land_army_t bestArmy = 0;
-			LandIndex bestAttackFrom = LandIndex::None;
-
-			for (int i = 0; i < l->neihboursLandIndex.size(); i++)
-			{
-				const Land* nl = Land::getLand(l->neihboursLandIndex[i]);
-				if ((nl->landIndexBitMask & pls->ownedLandsWithArmy) > 0)
-				{
-					land_army_t attackArmy = state.getLandArmy(nl->landIndex).army - 1;
-					if (attackArmy > bestArmy)
-					{
-						bestArmy = attackArmy;
-						bestAttackFrom = nl->landIndex;
-					}
-				}
-			}
-
-			state.attackMove(bestAttackFrom, li);
+			state.attackMove(getAttackFrom(state, li), li, outcome);
 		}
 		else if (state.getRoundPhase() == RoundPhase::ATTACK_MOBILIZATION) // Move or don't move units
 		{
@@ -231,3 +236,136 @@ void UtilityNN::makeMove(State& state, LandIndex li)
 		}
 	}
 }
+
+/*
+	Outcome is sampled from exact battle outcome probabilities, same distribution as rolled dice of State::attackMove.
+*/
+const BattleOutcome* UtilityNN::rollBattleOutcome(const State& state, LandIndex li, std::default_random_engine& engine)
+{
+	if (state.getRoundPhase() != RoundPhase::ATTACK || li == LandIndex::Count || state.getLandArmy(li).army == 0)
+	{
+		return nullptr;
+	}
+
+	const BattleOutcomes& outcomes = state.getBattleOutcomes(getAttackFrom(state, li), li);
+	float r = std::uniform_real_distribution<float>(0.0f, 1.0f)(engine);
+	for (int i = 0; i < outcomes.size - 1; i++)
+	{
+		r -= outcomes.outcome[i].probability;
+		if (r < 0.0f)
+		{
+			return &outcomes.outcome[i];
+		}
+	}
+	return &outcomes.outcome[outcomes.size - 1];
+}
+
+bool UtilityNN::makeForcedMove(State& state, std::default_random_engine* dice)
+{
+	if (state.gameStatus() != State::NOT_ENDED)
+	{
+		return false;
+	}
+
+	uint64_t validMoves = getValidMoves(state);
+	if (Utility::popcount(validMoves) != 1)
+	{
+		return false;
+	}
+
+	LandIndex li = Utility::lm2li(validMoves);
+	makeMove(state, li, dice != nullptr ? rollBattleOutcome(state, li, *dice) : nullptr);
+	return true;
+}
+
+int UtilityNN::makeForcedMoves(State& state, std::default_random_engine* dice)
+{
+	int count = 0;
+	while (makeForcedMove(state, dice))
+	{
+		count++;
+	}
+	return count;
+}
+
+/*
+	Whole turn reinforcement as single decision. Policy over lands is split into MIN_UNIT_MOVE chunks by largest remainder,
+	units that do not fit on land are placed on next best lands.
+*/
+void UtilityNN::makeReinforcementAllocation(State& state, const std::vector<float>& policy)
+{
+	GameHelper::playCards(state);
+
+	std::vector<std::pair<float, LandIndex>> lands; // Weight, land
+	float weightSum = 0.0f;
+
+	uint64_t tvm = getValidMoves(state) & ~Land::SKIP_MOVE_MASK;
+	while (tvm > 0)
+	{
+		uint64_t m = Utility::getFirstBitMask(tvm);
+		tvm &= ~m;
+
+		float w = policy[Utility::lm2i(m)];
+		lands.push_back({ w, Utility::lm2li(m) });
+		weightSum += w;
+	}
+
+	if (lands.empty())
+	{
+		state.gotoAttack();
+		return;
+	}
+
+	std::sort(lands.begin(), lands.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+
+	int chunks = (state.getReinforcement() + SETTINGS.MIN_UNIT_MOVE - 1) / SETTINGS.MIN_UNIT_MOVE;
+	std::vector<int> landChunks(lands.size());
+	std::vector<std::pair<float, int>> remainders; // Fraction, land position
+
+	int assigned = 0;
+	for (int i = 0; i < lands.size(); i++)
+	{
+		float share = weightSum > 0.0f ? lands[i].first / weightSum : 1.0f / lands.size();
+		float exact = share * chunks;
+		landChunks[i] = (int)exact;
+		assigned += landChunks[i];
+		remainders.push_back({ exact - landChunks[i], i });
+	}
+
+	std::stable_sort(remainders.begin(), remainders.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+	for (int i = 0; assigned < chunks; i++, assigned++)
+	{
+		landChunks[remainders[i % remainders.size()].second]++;
+	}
+
+	for (int pass = 0; pass < 2; pass++) // Second pass places units that did not fit
+	{
+		for (int i = 0; i < lands.size() && state.getRoundPhase() == RoundPhase::REINFORCEMENT; i++)
+		{
+			int amount = pass == 0 ? landChunks[i] * SETTINGS.MIN_UNIT_MOVE : state.getReinforcement();
+			amount = __MIN(amount, (int)state.getReinforcement());
+			amount = __MIN(amount, (int)state.getLandArmySpace(lands[i].second));
+			if (amount > 0)
+			{
+				state.reinforcementMove(amount, lands[i].second); // Goes to attack, when all reinforcement is placed
+			}
+		}
+	}
+
+	if (state.getRoundPhase() == RoundPhase::REINFORCEMENT) // All lands are full
+	{
+		state.gotoAttack();
+	}
+}
+
+void UtilityNN::makePolicyMove(State& state, LandIndex li, const std::vector<float>& policy)
+{
+	if (SETTINGS.MACRO_REINFORCEMENT && state.getRoundPhase() == RoundPhase::REINFORCEMENT && li != LandIndex::Count)
+	{
+		makeReinforcementAllocation(state, policy);
+	}
+	else
+	{
+		makeMove(state, li);
+	}
+}
@@ -4,8 +4,16 @@
 #include "../game_helper.h"
 #include "../../game/game.h"
 
+#include <random>
+
 namespace UtilityNN
 {
 	uint64_t getValidMoves(const State& state);
-	void makeMove(State& state, LandIndex li);	
+	LandIndex getAttackFrom(const State& state, LandIndex li); // Neighbouring owned land with most army
+	void makeMove(State& state, LandIndex li, const BattleOutcome* outcome = nullptr); // Outcome is used only for attack moves
+	const BattleOutcome* rollBattleOutcome(const State& state, LandIndex li, std::default_random_engine& engine); // Dice round of attack move from engine, nullptr when move rolls no dice
+	void makeReinforcementAllocation(State& state, const std::vector<float>& policy); // Places all reinforcement of turn by policy
+	void makePolicyMove(State& state, LandIndex li, const std::vector<float>& policy); // Picked move, or macro action when enabled
+	bool makeForcedMove(State& state, std::default_random_engine* dice = nullptr); // Plays move if it is the only valid one, attack dice from engine when set
+	int makeForcedMoves(State& state, std::default_random_engine* dice = nullptr); // Plays chain of forced moves till next real decision, returns moves played
 }
\ No newline at end of file
@@ -2,21 +2,30 @@
 
 void AlphaZeroPlayer::takeTurn(State& state)
 {
-	mcts.getStorage()->trimNodes();
+	mcts.stopPondering();
 	while (state.gameStatus() == -1 && state.getCurrentPlayerTurn() == playerIndexTurn)
 	{
-		mcts.simulate(state, this->nn);
+		if (mcts.skipForcedMove(state))
+		{
+			continue;
+		}
+
+		mcts.simulate(state, this->nn, true, trainStorage == nullptr);
 
-		std::shared_ptr<StateSimulations> ss = mcts.getStorage()->getStateSimulation(state);
-		std::vector<float> policy = ss->calculateMoveProbability(1.0f);
-		LandIndex li = mcts.pickHigestWeightedMove(policy);
+		std::vector<float> policy = mcts.calculatePolicy(state);
+		LandIndex li = mcts.pickMove(policy, false);
 
 		if (trainStorage != nullptr)
 		{
-			trainStorage->data.push_back(NNTrainData(state.getCurrentPlayerTurn(), NNInputData(state), NNOutputData(std::move(policy))));
+			trainStorage->data.push_back(NNTrainData(state.getCurrentPlayerTurn(), NNInputData(state), NNOutputData(std::vector<float>(policy))));
 		}
 
-		UtilityNN::makeMove(state, li);
+		UtilityNN::makePolicyMove(state, li, policy);
+	}
+
+	if (SETTINGS.MCTS_PONDER)
+	{
+		mcts.startPondering(state, this->nn);
 	}
 }
 
@@ -26,24 +35,35 @@ void AlphaZeroPlayer::gameFinished(int gameStatus, int roundCount)
 	{
 		trainStorage->updateValues(gameStatus, roundCount);
 	}
+	mcts.stopPondering();
+	mcts.logGameStats();
 }
 
 void AlphaZeroPlayer::newGame()
 {
-	mcts.getStorage()->clearNodes();
+	mcts.stopPondering();
+	mcts.clearNodes();
 }
 
-AlphaZeroPlayerGroup::AlphaZeroPlayerGroup(std::shared_ptr<AlphaZeroNNGroup> nnGroup)
+AlphaZeroPlayerGroup::AlphaZeroPlayerGroup(std::shared_ptr<AlphaZeroNNGroup> nnGroup, int rootTrees)
 {
 	for (int i = 0; i < nnGroup->size(); i++)
 	{
 		for (int g = 0; g < SETTINGS.NUMBER_OF_CONCURENT_GAMES_PER_GPU; g++)
 		{
-			alphaZeroPlayers.push_back(std::shared_ptr<AlphaZeroPlayer>(new AlphaZeroPlayer(nnGroup->getNN(i))));
+			alphaZeroPlayers.push_back(std::shared_ptr<AlphaZeroPlayer>(new AlphaZeroPlayer(nnGroup->getNN(i), rootTrees)));
 		}		
 	}
 }
 
+AlphaZeroPlayerGroup::AlphaZeroPlayerGroup(int size, int rootTrees)
+{
+	for (int i = 0; i < size; i++)
+	{
+		alphaZeroPlayers.push_back(std::shared_ptr<AlphaZeroPlayer>(new AlphaZeroPlayer(nullptr, rootTrees)));
+	}
+}
+
 size_t AlphaZeroPlayerGroup::size()
 {
 	return alphaZeroPlayers.size();
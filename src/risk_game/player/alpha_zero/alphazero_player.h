@@ -11,7 +11,14 @@ private:
 	AlphaZeroMCTS mcts;
 
 public:
-	AlphaZeroPlayer(std::shared_ptr<AlphaZeroNNId> nnId) : nn(nnId) {};
+	AlphaZeroPlayer(std::shared_ptr<AlphaZeroNNId> nnId, int rootTrees = 1) : nn(nnId) // Without NN searches with heuristic evaluator
+	{
+		mcts.setRootTrees(rootTrees);
+		if (nnId == nullptr || SETTINGS.HYBRID_NN_WEIGHT < 1.0f)
+		{
+			mcts.setLeafEvaluator(std::shared_ptr<LeafEvaluator>(new HeuristicEvaluator(SETTINGS.ROLLOUT_DEPTH)), nnId == nullptr ? 0.0f : SETTINGS.HYBRID_NN_WEIGHT);
+		}
+	};
 
 	void takeTurn(State& game) override;
 	void gameFinished(int gameStatus, int roundCount) override;
@@ -25,7 +32,8 @@ private:
 	std::vector<std::shared_ptr<AlphaZeroPlayer>> alphaZeroPlayers;
 
 public:
-	AlphaZeroPlayerGroup(std::shared_ptr<AlphaZeroNNGroup> nnGroup);
+	AlphaZeroPlayerGroup(std::shared_ptr<AlphaZeroNNGroup> nnGroup, int rootTrees = 1);
+	AlphaZeroPlayerGroup(int size, int rootTrees = 1); // Heuristic search players without NN
 
 	size_t size() override;
 	std::shared_ptr<Player> getPlayer(int index) override;
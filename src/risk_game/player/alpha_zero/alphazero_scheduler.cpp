@@ -0,0 +1,75 @@
+#include "alphazero_scheduler.h"
+
+MCTSScheduler::MCTSScheduler(int threads)
+{
+	threads = __MAX(1, threads);
+	printf("Starting MCTS scheduler with %d threads\n", threads);
+
+	for (int i = 0; i < threads; i++)
+	{
+		workers.push_back(std::thread(&MCTSScheduler::threadRunWorker, this));
+	}
+}
+
+MCTSScheduler::~MCTSScheduler()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		running = false;
+	}
+	cvReady.notify_all();
+
+	for (auto& w : workers)
+	{
+		w.join();
+	}
+}
+
+void MCTSScheduler::threadRunWorker()
+{
+	while (true)
+	{
+		std::coroutine_handle<> handle;
+		{
+			std::unique_lock ul(lock);
+			cvReady.wait(ul, [this] { return !readyQueue.empty() || !running; });
+			if (readyQueue.empty()) // Stopped and nothing left to run
+			{
+				return;
+			}
+
+			handle = readyQueue.front();
+			readyQueue.pop_front();
+		}
+		handle.resume(); // Runs till next co_await or end of simulation
+	}
+}
+
+void MCTSScheduler::schedule(std::coroutine_handle<> handle)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		readyQueue.push_back(handle);
+	}
+	cvReady.notify_one();
+}
+
+void MCTSScheduler::schedule(const std::vector<std::coroutine_handle<>>& handles)
+{
+	if (handles.empty())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		readyQueue.insert(readyQueue.end(), handles.begin(), handles.end());
+	}
+	cvReady.notify_all();
+}
+
+MCTSScheduler& MCTSScheduler::getInstance()
+{
+	static MCTSScheduler INSTANCE(SETTINGS.MCTS_SCHEDULER_THREADS);
+	return INSTANCE;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../../../settings.h"
+
+
+class MCTSScheduler // Thread safe class
+{
+private:
+	std::mutex lock;
+	std::condition_variable cvReady;
+	std::deque<std::coroutine_handle<>> readyQueue;
+
+	bool running = true;
+	std::vector<std::thread> workers;
+
+	void threadRunWorker();
+
+public:
+	MCTSScheduler(int threads);
+	~MCTSScheduler();
+
+	void schedule(std::coroutine_handle<> handle);
+	void schedule(const std::vector<std::coroutine_handle<>>& handles);
+
+	static MCTSScheduler& getInstance();
+};
+
+
+/*
+	Fire and forget coroutine, started on scheduler worker thread.
+	Frame is destroyed when coroutine finishes, caller must synchronize completion by itself.
+*/
+class SimulationTask
+{
+public:
+	class promise_type
+	{
+	public:
+		struct ScheduleOnWorker
+		{
+			bool await_ready() { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { MCTSScheduler::getInstance().schedule(handle); }
+			void await_resume() {}
+		};
+
+		SimulationTask get_return_object() { return SimulationTask(); }
+		ScheduleOnWorker initial_suspend() { return ScheduleOnWorker(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
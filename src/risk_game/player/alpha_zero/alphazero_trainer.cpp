@@ -1,5 +1,14 @@
 #include "alphazero_trainer.h"
 
+void SelfPlayStats::add(const SelfPlayStats& other)
+{
+	games += other.games;
+	positions += other.positions;
+	samples += other.samples;
+	simulations += other.simulations;
+	policyKL += other.policyKL;
+}
+
 AlphaZeroTrainer::AlphaZeroTrainer()
 {
 	trainIteration = 0;
@@ -9,8 +18,9 @@ AlphaZeroTrainer::AlphaZeroTrainer()
 	scriptPlayerGroup = std::shared_ptr<ScriptPlayerGroup>(new ScriptPlayerGroup(SETTINGS.getNumberOfPlayers()));
 }
 
-void AlphaZeroTrainer::train(std::shared_ptr<AlphaZeroNNGroup> trainGroup, std::shared_ptr<AlphaZeroNNGroup> generateGroup)
+void AlphaZeroTrainer::train(std::shared_ptr<AlphaZeroNNGroup> trainGroup, std::shared_ptr<AlphaZeroNNGroup> generateGroup, std::shared_ptr<AlphaZeroNNGroup> selfPlayNNGroup)
 {
+	selfPlayGroup = selfPlayNNGroup != nullptr ? selfPlayNNGroup : generateGroup;
 	trainStorage.loadTrainingSamples(SETTINGS.DEFAULT_SAMPLES);
 	trainStorage.registerHandler();
 
@@ -19,7 +29,7 @@ void AlphaZeroTrainer::train(std::shared_ptr<AlphaZeroNNGroup> trainGroup, std::
 	{
 		printf("Train iteration %d\n", trainIteration);
 
-		generateTrainData(generateGroup);
+		generateTrainData(selfPlayGroup);
 		trainStorage.trimOldExamples();
 
 		trainGroup->train(trainStorage.data, SETTINGS.EPOCHS);
@@ -37,6 +47,7 @@ void AlphaZeroTrainer::generateTrainData(std::shared_ptr<AlphaZeroNNGroup> gener
 {
 	int currentSampelCount = trainStorage.data.size();
 	printf("Generating training data current sample count %d\n", currentSampelCount);
+	generate->calibrate(trainStorage); // Quantized backend ranges follow stored positions
 
 	std::vector<std::thread> threads; threads.reserve(generate->size());
 	std::vector<NNTrainDataStorage> storageGroup; storageGroup.resize(generate->size());
@@ -45,6 +56,9 @@ void AlphaZeroTrainer::generateTrainData(std::shared_ptr<AlphaZeroNNGroup> gener
 	c->setCount(SETTINGS.TRAIN_ITERATION_GAMES);
 	c->setShowProgress(true);
 
+	selfPlayStats = SelfPlayStats();
+	auto start = std::chrono::steady_clock::now();
+
 	for (int i = 0; i < generate->size(); i++) // Spawn threads
 	{
 		std::shared_ptr<AlphaZeroNNId> nn = generate->getNN(i);
@@ -55,6 +69,7 @@ void AlphaZeroTrainer::generateTrainData(std::shared_ptr<AlphaZeroNNGroup> gener
 	{
 		threads[i].join();
 	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 	
 	for (auto& s : storageGroup)
 	{
@@ -62,6 +77,9 @@ void AlphaZeroTrainer::generateTrainData(std::shared_ptr<AlphaZeroNNGroup> gener
 	}
 
 	printf("\n");
+	logSelfPlayStats(seconds);
+	NNEvaluationCache::getInstance().logStats();
+
 	if (SETTINGS.PERSIST_SAMPLES_DATA)
 	{
 		printf("Storing new training samples to disk\n");
@@ -82,6 +100,7 @@ void AlphaZeroTrainer::threadExecuteTrainingGame(std::shared_ptr<AlphaZeroNNId>
 	while (c->hasNext())
 	{
 		AlphaZeroMCTS mcts = AlphaZeroMCTS();
+		SelfPlayStats gameStats;
 
 		State rootState = State();
 		rootState.setLog(SETTINGS.LOG_STATE);
@@ -90,34 +109,68 @@ void AlphaZeroTrainer::threadExecuteTrainingGame(std::shared_ptr<AlphaZeroNNId>
 		int8_t gameState = -1;
 		for (int i = 0; gameState == -1; i++)
 		{
-			mcts.simulate(rootState, nn);			
+			if (mcts.skipForcedMove(rootState)) // Not searched and not recorded, target would be trivial
+			{
+				gameState = rootState.gameStatus();
+				continue;
+			}
+
+			bool fullSearch = SETTINGS.MCTS_FULL_SEARCH_PROBABILITY >= 1.0f || RNG.rFloat() < SETTINGS.MCTS_FULL_SEARCH_PROBABILITY; // Playout cap randomization, off at 1
+			bool explore = rootState.getRound() <= SETTINGS.TEMPERATURE_TRESHOLD; // Temp 0.0f => best move
+			gameStats.simulations += mcts.simulate(rootState, nn, fullSearch, !fullSearch && !explore);
+			gameStats.positions++;
 
-			std::shared_ptr<StateSimulations> ss = mcts.getStorage()->getStateSimulation(rootState);
-			std::vector<float> policy = ss->calculateMoveProbability(1.0f);
+			std::vector<float> policy = mcts.calculatePolicy(rootState);
+			LandIndex li = mcts.pickMove(policy, explore);
 
-			LandIndex li;
-			if (rootState.getRound() > SETTINGS.TEMPERATURE_TRESHOLD) // Temp 0.0f => best move
+			if (fullSearch) // Fast search policy is too noisy to train on
 			{
-				li = mcts.pickHigestWeightedMove(policy);
+				gameStats.policyKL += mcts.getStorage()->getStateSimulation(rootState)->calculatePriorKL(policy);
+				gameStats.samples++;
+				nnStorage->data.push_back(NNTrainData(rootState.getCurrentPlayerTurn(), NNInputData(rootState), NNOutputData(std::vector<float>(policy))));
 			}
-			else
-			{
-				li = mcts.pickRandomWeightedMove(policy);
-			}			
 
-			nnStorage->data.push_back(NNTrainData(rootState.getCurrentPlayerTurn(), NNInputData(rootState), NNOutputData(std::move(policy))));
-
-			UtilityNN::makeMove(rootState, li);
+			UtilityNN::makePolicyMove(rootState, li, policy); // Policy is used by macro actions
 			gameState = rootState.gameStatus();
 		}
 		rootState.logGameStatus();
+		mcts.logGameStats();
 
 		nnStorage->updateValues(gameState, rootState.getRound());
+		gameStats.games++;
+		{
+			std::lock_guard<std::mutex> guard(statsLock);
+			selfPlayStats.add(gameStats);
+		}
 
 		c->hasFinished();
 	}
 }
 
+/*
+	Self play throughput and sample quality, compared to fixed budget of MCTS_SIMULATIONS for every position.
+*/
+void AlphaZeroTrainer::logSelfPlayStats(double seconds)
+{
+	const SelfPlayStats& s = selfPlayStats;
+	if (s.positions == 0)
+	{
+		return;
+	}
+
+	double gamesPerHour = s.games * 3600.0 / __MAX(seconds, 1e-3);
+	double positionsPerHour = s.positions * 3600.0 / __MAX(seconds, 1e-3);
+	double samplesPerHour = s.samples * 3600.0 / __MAX(seconds, 1e-3);
+	double avgSimulations = double(s.simulations) / s.positions;
+	double budgetRatio = avgSimulations / __MAX(1, SETTINGS.MCTS_SIMULATIONS);
+	double avgKL = s.samples > 0 ? s.policyKL / s.samples : 0.0;
+
+	printf("Self play games %llu (%.0f/h), positions %llu (%.0f/h), samples %llu (%.0f/h), avg. simulations %.1f (%.2f of fixed budget), avg. target KL from prior %.3f\n",
+		(unsigned long long)s.games, gamesPerHour, (unsigned long long)s.positions, positionsPerHour, (unsigned long long)s.samples, samplesPerHour, avgSimulations, budgetRatio, avgKL);
+	LOG.getSelfPlayLog() << trainIteration << ", " << s.games << ", " << gamesPerHour << ", " << s.positions << ", " << positionsPerHour << ", " << s.samples << ", " << samplesPerHour << ", "
+		<< avgSimulations << ", " << budgetRatio << ", " << avgKL << std::endl;
+}
+
 void AlphaZeroTrainer::benchmark(std::shared_ptr<AlphaZeroPlayerGroup> azpg)
 {
 	printf("Playing benchmark games with random\n");
@@ -159,7 +212,7 @@ bool AlphaZeroTrainer::updateIfImprovement(std::shared_ptr<AlphaZeroNNGroup> tra
 			printf("Model improved\n");
 			trainGroup->saveCheckpoint(SETTINGS.DEFAULT_BEST_CHECKPOINT);
 			trainGroup->saveCheckpoint(SETTINGS.DEFAULT_CHECKPOINT_DIR + "/checkpoint-iter-" + std::to_string(trainIteration) + ".bin");
-			generateGroup->loadCheckpoint(SETTINGS.DEFAULT_BEST_CHECKPOINT);
+			loadBestModel(generateGroup);
 			
 			if(doBenchmark) benchmark(generateAZPG);
 			return true;
@@ -181,7 +234,7 @@ bool AlphaZeroTrainer::updateIfImprovement(std::shared_ptr<AlphaZeroNNGroup> tra
 		trainGroup->saveCheckpoint(SETTINGS.DEFAULT_BEST_CHECKPOINT);
 		trainGroup->saveCheckpoint(SETTINGS.DEFAULT_CHECKPOINT_DIR + "/checkpoint-iter-" + std::to_string(trainIteration) + ".bin");
 		
-		generateGroup->loadCheckpoint(SETTINGS.DEFAULT_BEST_CHECKPOINT);
+		loadBestModel(generateGroup);
 
 		std::shared_ptr<AlphaZeroPlayerGroup> generateAZPG(new AlphaZeroPlayerGroup(generateGroup));
 		if (doBenchmark) benchmark(generateAZPG);
@@ -189,6 +242,15 @@ bool AlphaZeroTrainer::updateIfImprovement(std::shared_ptr<AlphaZeroNNGroup> tra
 	}
 }
 
+void AlphaZeroTrainer::loadBestModel(std::shared_ptr<AlphaZeroNNGroup> generateGroup)
+{
+	generateGroup->loadCheckpoint(SETTINGS.DEFAULT_BEST_CHECKPOINT);
+	if (selfPlayGroup != nullptr && selfPlayGroup != generateGroup)
+	{
+		selfPlayGroup->loadCheckpoint(SETTINGS.DEFAULT_BEST_CHECKPOINT);
+	}
+}
+
 bool AlphaZeroTrainer::isModelImproved(const GameResults& gr)
 {
 	PlayerGameResult newModel = gr.players[0];
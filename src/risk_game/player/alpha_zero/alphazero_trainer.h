@@ -6,17 +6,35 @@
 #include "../random/random_player.h"
 #include "../script/script_player.h"
 
+class SelfPlayStats
+{
+public:
+	uint64_t games = 0;
+	uint64_t positions = 0;
+	uint64_t samples = 0; // Positions of full searches, recorded as training samples
+	uint64_t simulations = 0;
+	double policyKL = 0.0; // Sum of KL divergence of recorded targets from prior, measure of sample quality
+
+	void add(const SelfPlayStats& other);
+};
+
 class AlphaZeroTrainer
 {
 private:
 	int trainIteration;
 
+	std::mutex statsLock;
+	SelfPlayStats selfPlayStats;
+	std::shared_ptr<AlphaZeroNNGroup> selfPlayGroup; // Same weights as generate group, can run other backend
+
 	void generateTrainData(std::shared_ptr<AlphaZeroNNGroup> nnModel);
 	void threadExecuteTrainingGame(std::shared_ptr<AlphaZeroNNId> nn, NNTrainDataStorage* nnStorage, std::shared_ptr<Counter> c);	
 		
 	bool isModelImproved(const GameResults& gr);
 	bool updateIfImprovement(std::shared_ptr<AlphaZeroNNGroup> newModel, std::shared_ptr<AlphaZeroNNGroup> oldModel, bool doBenchmark);
 	void benchmark(std::shared_ptr<AlphaZeroPlayerGroup> nnModel);
+	void logSelfPlayStats(double seconds);
+	void loadBestModel(std::shared_ptr<AlphaZeroNNGroup> generateGroup);
 
 public:
 	NNTrainDataStorage trainStorage;
@@ -25,7 +43,7 @@ public:
 	std::shared_ptr<ScriptPlayerGroup> scriptPlayerGroup;
 
 	AlphaZeroTrainer();
-	void train(std::shared_ptr<AlphaZeroNNGroup> nnGroup, std::shared_ptr<AlphaZeroNNGroup> oldNNGroup);
+	void train(std::shared_ptr<AlphaZeroNNGroup> nnGroup, std::shared_ptr<AlphaZeroNNGroup> oldNNGroup, std::shared_ptr<AlphaZeroNNGroup> selfPlayNNGroup = nullptr); // Self play group defaults to old group
 	void trainOnScript(std::shared_ptr<AlphaZeroNNGroup> nnGroup, std::shared_ptr<AlphaZeroNNGroup> oldNNGroup);
 	void trainOnGeneratedData(std::shared_ptr<AlphaZeroNNGroup> nn, std::shared_ptr<AlphaZeroNNGroup> nnOld);
 };
@@ -10,6 +10,24 @@ std::string AlphaZeroGPU::getDeviceTag()
 	return deviceTag;
 }
 
+void AlphaZeroGPU::threadEncodePredictions(int nnIndex)
+{
+	std::shared_ptr<AlphaZeroNN> nn = neuralNetworks[nnIndex];
+	while (running)
+	{
+		nn->encodeBatch();
+	}
+}
+
+void AlphaZeroGPU::threadDeliverPredictions(int nnIndex)
+{
+	std::shared_ptr<AlphaZeroNN> nn = neuralNetworks[nnIndex];
+	while (running)
+	{
+		nn->deliverBatch();
+	}
+}
+
 void AlphaZeroGPU::threadProcessPredictions(int nnIndex)
 {
 	std::shared_ptr<AlphaZeroNN> nn = neuralNetworks[nnIndex];
@@ -27,7 +45,7 @@ void AlphaZeroGPU::threadProcessPredictions(int nnIndex)
 		auto startWaiting = std::chrono::high_resolution_clock::now();
 #endif // LOG_PERFORMANCE
 
-		nn->waitQueueToFill();
+		int slot = nn->waitBatchEncoded();
 
 #ifdef LOG_PERFORMANCE
 		auto endWaiting = std::chrono::high_resolution_clock::now();
@@ -35,7 +53,7 @@ void AlphaZeroGPU::threadProcessPredictions(int nnIndex)
 #endif // LOG_PERFORMANCE
 
 		std::lock_guard<std::mutex> lock_gpu(lock);
-		int samples = nn->processBatchPrediction();
+		int samples = nn->runBatch(slot);
 						
 #ifdef LOG_PERFORMANCE
 		auto endProcessing = std::chrono::high_resolution_clock::now();
@@ -55,14 +73,17 @@ void AlphaZeroGPU::threadProcessPredictions(int nnIndex)
 			LOG.getNNPerformanceLog() << std::chrono::duration_cast<std::chrono::nanoseconds>(waitingDuration).count() << " ns, "
 				<< std::chrono::duration_cast<std::chrono::nanoseconds>(processingDuration).count() << " ns, "
 				<< nanosecondsPerSample << " ns/sample, "
-				<< samples << " samples" << std::endl;
+				<< samples << " samples, "
+				<< SETTINGS.MCTS_LEAVES_PER_DESCENT << " leaves per descent" << std::endl;
 		}
 		else if (countPerformanceLog == 110)
 		{
 			auto nanosecondsPerSample = std::chrono::duration_cast<std::chrono::nanoseconds>(totalProcessing).count() / totalSamples;
 			LOG.getNNPerformanceLog() << "AVG: " << std::chrono::duration_cast<std::chrono::nanoseconds>(totalWaiting).count() / 100 << " ns, "
 				<< std::chrono::duration_cast<std::chrono::nanoseconds>(totalProcessing).count() / 100 << " ns, "
-				<< nanosecondsPerSample << " ns/sample" << std::endl;
+				<< nanosecondsPerSample << " ns/sample, "
+				<< double(totalSamples) / 100 << " samples/batch, "
+				<< SETTINGS.MCTS_LEAVES_PER_DESCENT << " leaves per descent" << std::endl;
 		}
 
 		countPerformanceLog++;
@@ -70,17 +91,19 @@ void AlphaZeroGPU::threadProcessPredictions(int nnIndex)
 	}
 }
 
-std::shared_ptr<AlphaZeroNNId> AlphaZeroGPU::addNeuralNetwork(std::string filePath)
+std::shared_ptr<AlphaZeroNNId> AlphaZeroGPU::addNeuralNetwork(std::string filePath, std::string backend)
 {
-	printf("Creating NN on gpu %s from graph %s\n", deviceTag.c_str(), filePath.c_str());
+	printf("Creating NN on gpu %s from graph %s with %s backend\n", deviceTag.c_str(), filePath.c_str(), backend.c_str());
 
 	std::lock_guard<std::mutex> guard(lock);
 
 	std::shared_ptr<AlphaZeroNN> nn = std::shared_ptr<AlphaZeroNN>(new AlphaZeroNN());
-	nn->loadGraph(filePath, deviceTag);
+	nn->loadGraph(filePath, deviceTag, backend);
 
 	neuralNetworks.push_back(nn);
-	processingThreads.push_back(std::thread(&AlphaZeroGPU::threadProcessPredictions, this, neuralNetworks.size()-1));
+	processingThreads.push_back(std::thread(&AlphaZeroGPU::threadEncodePredictions, this, neuralNetworks.size() - 1));
+	processingThreads.push_back(std::thread(&AlphaZeroGPU::threadProcessPredictions, this, neuralNetworks.size() - 1));
+	processingThreads.push_back(std::thread(&AlphaZeroGPU::threadDeliverPredictions, this, neuralNetworks.size() - 1));
 
 	return std::shared_ptr<AlphaZeroNNId>(new AlphaZeroNNId(cluster, gpuIndex, neuralNetworks.size() - 1));
 }
@@ -102,6 +125,12 @@ NNOutputData AlphaZeroGPU::predict(int nnIndex, const NNInputData& state)
 	return neuralNetworks[nnIndex]->predict(state);
 }
 
+BackendError AlphaZeroGPU::compareBackend(int nnIndex, const std::vector<NNInputData>& states, std::string referenceName)
+{
+	std::lock_guard guard(lock);
+	return neuralNetworks[nnIndex]->compareBackend(states, referenceName);
+}
+
 void AlphaZeroCluster::initGpus(std::shared_ptr<AlphaZeroCluster> cluster, int numberOfGpus)
 {
 	printf("Initializing gpus: %d\n", numberOfGpus);
@@ -115,7 +144,7 @@ void AlphaZeroCluster::initGpus(std::shared_ptr<AlphaZeroCluster> cluster, int n
 std::shared_ptr<AlphaZeroNNId> AlphaZeroCluster::addNeuralNetwork(int gpuIndex, std::string grouprName, std::string filePath)
 {
 	printf("Creating NN for group %s\n", grouprName.c_str());
-	std::shared_ptr<AlphaZeroNNId> id = gpus[gpuIndex]->addNeuralNetwork(filePath);
+	std::shared_ptr<AlphaZeroNNId> id = gpus[gpuIndex]->addNeuralNetwork(filePath, SETTINGS.NN_BACKEND);
 
 	if (!grouprName.empty())
 	{		
@@ -141,8 +170,13 @@ std::shared_ptr<AlphaZeroNNGroup> AlphaZeroCluster::getGroup(std::string groupNa
 	return groups[groupName];
 }
 
-std::shared_ptr<AlphaZeroNNGroup> AlphaZeroCluster::initPlayerGroup(std::string groupName, std::string graphFilePath)
+std::shared_ptr<AlphaZeroNNGroup> AlphaZeroCluster::initPlayerGroup(std::string groupName, std::string graphFilePath, std::string backend)
 {
+	if (backend.empty())
+	{
+		backend = SETTINGS.NN_BACKEND;
+	}
+
 	if (!groups.contains(groupName))
 	{
 		std::shared_ptr<AlphaZeroNNGroup> group(new AlphaZeroNNGroup(groupName));
@@ -151,7 +185,7 @@ std::shared_ptr<AlphaZeroNNGroup> AlphaZeroCluster::initPlayerGroup(std::string
 		for (auto& gpu : gpus)
 		{
 			printf("Creating NN for group %s\n", groupName.c_str());
-			std::shared_ptr<AlphaZeroNNId> nnId = gpu->addNeuralNetwork(graphFilePath);
+			std::shared_ptr<AlphaZeroNNId> nnId = gpu->addNeuralNetwork(graphFilePath, backend);
 			group->add(nnId);
 		}
 
@@ -171,9 +205,11 @@ void AlphaZeroNNId::loadCheckpoint(std::string filePath)
 
 void AlphaZeroNNGroup::loadCheckpoint(std::string filePath)
 {
+	uint64_t version = NNEvaluationCache::newVersion();
 	for (auto& id : neuralNetworkIds)
 	{
 		id->loadCheckpoint(filePath);
+		id->setVersion(version); // Same weights share cached evaluations
 	}
 }
 
@@ -193,6 +229,11 @@ void AlphaZeroNNId::train(const std::vector<NNTrainData>& trainData, int epochs)
 	cluster->getGPU(gpuIndex)->train(nnId, trainData, epochs);
 }
 
+void AlphaZeroNNId::setVersion(uint64_t version)
+{
+	cluster->getGPU(gpuIndex)->getNN(nnId)->setVersion(version);
+}
+
 void AlphaZeroNNId::registerThread()
 {
 	cluster->getGPU(gpuIndex)->getNN(nnId)->registerThread();
@@ -208,11 +249,26 @@ std::future<NNOutputData> AlphaZeroNNId::predictFuture(const NNInputData& state)
 	return cluster->getGPU(gpuIndex)->getNN(nnId)->predictFuture(state);
 }
 
+NNPredictionAwaiter AlphaZeroNNId::predictAsync(std::vector<NNInputData> states, bool lowPriority)
+{
+	return NNPredictionAwaiter(cluster->getGPU(gpuIndex)->getNN(nnId).get(), std::move(states), lowPriority);
+}
+
 NNOutputData AlphaZeroNNId::predict(const NNInputData& state)
 {
 	return cluster->getGPU(gpuIndex)->predict(nnId, state);
 }
 
+bool AlphaZeroNNId::calibrate(const std::vector<NNInputData>& states)
+{
+	return cluster->getGPU(gpuIndex)->getNN(nnId)->calibrate(states);
+}
+
+BackendError AlphaZeroNNId::compareBackend(const std::vector<NNInputData>& states, std::string referenceName)
+{
+	return cluster->getGPU(gpuIndex)->compareBackend(nnId, states, referenceName);
+}
+
 void AlphaZeroNNGroup::add(std::shared_ptr<AlphaZeroNNId> instance)
 {
 	neuralNetworkIds.push_back(instance);
@@ -224,9 +280,36 @@ void AlphaZeroNNGroup::train(const std::vector<NNTrainData>& trainData, int epoc
 	nn->train(trainData, epochs);
 	nn->saveCheckpoint(SETTINGS.DEFAULT_CHECKPOINT_TEMP);
 
+	uint64_t version = NNEvaluationCache::newVersion();
+	nn->setVersion(version);
 	for (int i=1; i<neuralNetworkIds.size(); i++)
 	{
 		neuralNetworkIds[i]->loadCheckpoint(SETTINGS.DEFAULT_CHECKPOINT_TEMP);
+		neuralNetworkIds[i]->setVersion(version);
+	}
+}
+
+void AlphaZeroNNGroup::calibrate(const NNTrainDataStorage& storage)
+{
+	if (storage.data.empty())
+	{
+		return;
+	}
+
+	int count = __MIN(SETTINGS.NN_CALIBRATION_SAMPLES, (int)storage.data.size());
+	std::vector<NNInputData> states;
+	for (int i = 0; i < count; i++) // Spread over whole storage, consecutive samples are from same game
+	{
+		states.push_back(storage.data[size_t(i) * storage.data.size() / count].in);
+	}
+
+	uint64_t version = NNEvaluationCache::newVersion();
+	for (auto& id : neuralNetworkIds)
+	{
+		if (id->calibrate(states))
+		{
+			id->setVersion(version);
+		}
 	}
 }
 
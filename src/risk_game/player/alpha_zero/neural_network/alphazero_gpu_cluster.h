@@ -27,12 +27,16 @@ public:
 	void loadCheckpoint(std::string filePath); // Thread safe
 	void saveCheckpoint(std::string filePath); // Thread safe
 	void train(const std::vector<NNTrainData>& trainData, int epochs); // Thread safe
+	void setVersion(uint64_t version); // Thread safe
 
 	void registerThread(); // Tell NN prediction batch to wait for thread
 	void unregisterThread(); // Tell NN prediction batch to stop waiting for thread
 
 	std::future<NNOutputData> predictFuture(const NNInputData& state); // Thread safe
+	NNPredictionAwaiter predictAsync(std::vector<NNInputData> states, bool lowPriority = false); // Thread safe, use with co_await, states are predicted in same batch
 	NNOutputData predict(const NNInputData& state); // Thread safe
+	bool calibrate(const std::vector<NNInputData>& states); // Thread safe
+	BackendError compareBackend(const std::vector<NNInputData>& states, std::string referenceName); // Thread safe
 };
 
 class AlphaZeroNNGroup
@@ -52,6 +56,7 @@ public:
 	void loadCheckpoint(std::string filePath);
 	void saveCheckpoint(std::string filePath);
 	void train(const std::vector<NNTrainData>& trainData, int epochs);
+	void calibrate(const NNTrainDataStorage& storage); // Quantized backends take activation ranges from sample of stored positions
 
 	int size();
 	std::shared_ptr<AlphaZeroNNId> getNN(int nnIndex);
@@ -72,18 +77,21 @@ private:
 	std::vector<std::shared_ptr<AlphaZeroNN>> neuralNetworks;
 	std::vector<std::thread> processingThreads;	
 
-	void threadProcessPredictions(int nnIndex); // Thread safe
+	void threadEncodePredictions(int nnIndex); // Thread safe
+	void threadProcessPredictions(int nnIndex); // Thread safe, only stage using gpu
+	void threadDeliverPredictions(int nnIndex); // Thread safe
 public:
 	AlphaZeroGPU(std::shared_ptr<AlphaZeroCluster> cluster, int gpuIndex): cluster(cluster), gpuIndex(gpuIndex), deviceTag(getDevicePath(gpuIndex)) 
 	{ 
 		printf("Initialized GPU %s\n", deviceTag.c_str());
 	};
 
-	std::shared_ptr<AlphaZeroNNId> addNeuralNetwork(std::string filePath);
+	std::shared_ptr<AlphaZeroNNId> addNeuralNetwork(std::string filePath, std::string backend);
 	std::shared_ptr<AlphaZeroNN> getNN(int nnIndex);
 	
 	void train(int nnIndex, const std::vector<NNTrainData>& trainData, int epochs); // Thread safe
 	NNOutputData predict(int nnIndex, const NNInputData& state); // Thread safe
+	BackendError compareBackend(int nnIndex, const std::vector<NNInputData>& states, std::string referenceName); // Thread safe
 
 	static std::string getDevicePath(int index);
 
@@ -107,5 +115,5 @@ public:
 	std::shared_ptr<AlphaZeroGPU> getGPU(int gpuIndex);
 	std::shared_ptr<AlphaZeroNNGroup> getGroup(std::string groupName);
 
-	std::shared_ptr<AlphaZeroNNGroup> initPlayerGroup(std::string groupName, std::string graphFilePath);
+	std::shared_ptr<AlphaZeroNNGroup> initPlayerGroup(std::string groupName, std::string graphFilePath, std::string backend = ""); // Empty backend is SETTINGS.NN_BACKEND
 };
\ No newline at end of file
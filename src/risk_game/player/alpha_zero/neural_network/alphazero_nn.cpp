@@ -1,5 +1,7 @@
 #include "alphazero_nn.h"
 
+#include <bit>
+
 std::string UtilityNN::getCheckpointName(std::string name)
 {
 	time_t curtime;
@@ -28,69 +30,28 @@ tensorflow::Tensor UtilityNN::buildTensor(float value)
 	return t;
 }
 
-void setInStateTensor(tensorflow::Tensor& t, int sampleRow, const NNInputData& data) // IMPORTANT, SET ALL FIELDS IN TENSOR
-{
-	for (int y = 0; y < MAP_Y; y++)
-	{		
-		for (int x = 0; x < MAP_X; x++)
-		{
-			const LandArmy& la = data.land[y * MAP_X + x];
-			float featureArmy = float(la.army) / LAND_ARMY_MAX;
-
-			int currentPlayer = data.playerIndex;
-			int enemyPlayer = currentPlayer == 0 ? 1 : 0;
-
-#if defined(INPUT_VECTOR_TYPE_1) || defined(INPUT_VECTOR_TYPE_2) || defined(INPUT_VECTOR_TYPE_3)
-			t.tensor<float, 4>()(sampleRow, y, x, IF_CURRENT_PLAYER) = currentPlayer == la.playerIndex ? featureArmy : 0.0f;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_ENEMY_PLAYER) = enemyPlayer == la.playerIndex ? featureArmy : 0.0f;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_NEUTRAL_PLAYER) = NEUTRAL_PLAYER == la.playerIndex ? featureArmy : 0.0f;
-
-			t.tensor<float, 4>()(sampleRow, y, x, IF_REINFORCEMENT_SHARE) = data.featureReinforcementShare;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_ATTACKS_DURING_TURN) = data.featureAttackFrequency;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_CAN_DRAW_CARD) = data.featureCanDrawCard;
-
-			t.tensor<float, 4>()(sampleRow, y, x, IF_PHASE_SETUP) = data.featureIsPhaseSetup;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_PHASE_SETUP_NEUTRAL) = data.featureIsPhaseSetupNeutral;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_PHASE_REINFORCEMENT) = data.featureIsPhaseReinforcement;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_PHASE_ATTACK) = data.featureIsPhaseAttack;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_PHASE_ATTACK_MOBILIZATION) = data.featureIsPhaseAttackMobilization;
-			t.tensor<float, 4>()(sampleRow, y, x, IF_PHASE_FORTIFY) = data.featureIsPhaseFortify;
-#if defined(INPUT_VECTOR_TYPE_2) || defined(INPUT_VECTOR_TYPE_3)
-			t.tensor<float, 4>()(sampleRow, y, x, IF_ARMY_SHARE) = data.featureArmyShare;
-#if defined(INPUT_VECTOR_TYPE_3)
-			t.tensor<float, 4>()(sampleRow, y, x, IF_ROUND) = float(data.round) / SETTINGS.MAX_GAME_ROUNDS;
-#endif
-#endif
-#endif
-		}		
-	}
-}
-
 tensorflow::Tensor UtilityNN::buildInTensor(const NNInputData& data)
 {
 	tensorflow::Tensor t(tensorflow::DT_FLOAT, tensorflow::TensorShape({ 1, MAP_Y, MAP_X, TF_INPUT_FEATURES }));
-	setInStateTensor(t, 0, data);
+	data.encode(t.flat<float>().data());
 	return t;
 }
 
-tensorflow::Tensor UtilityNN::buildInsFutureTensor(const std::vector<FuturePrediction>& values)
+void UtilityNN::fillInsFuture(float* out, const std::vector<FuturePrediction>& values)
 {
-	tensorflow::Tensor t(tensorflow::DT_FLOAT, tensorflow::TensorShape({ (int) values.size(), MAP_Y, MAP_X, TF_INPUT_FEATURES }));
-	for (int i = 0; i < values.size(); i++)
+	for (int i = 0; i < values.size(); i++, out += TF_INPUT_TENSOR_SIZE)
 	{
-		auto& data = values[i].in;
-		setInStateTensor(t, i, data);
+		values[i].in.encode(out);
 	}
-	return t;
 }
 
 tensorflow::Tensor UtilityNN::buildInsTensor(const std::vector<const NNInputData*>& values)
 {
 	tensorflow::Tensor t(tensorflow::DT_FLOAT, tensorflow::TensorShape({ (int)values.size(), MAP_Y, MAP_X, TF_INPUT_FEATURES }));
-	for (int i = 0; i < values.size(); i++)
+	float* out = t.flat<float>().data();
+	for (int i = 0; i < values.size(); i++, out += TF_INPUT_TENSOR_SIZE)
 	{
-		auto& data = *values[i];
-		setInStateTensor(t, i, data);
+		values[i]->encode(out);
 	}
 	return t;
 }
@@ -148,20 +109,13 @@ tensorflow::Tensor UtilityNN::buildOutsPolicyTensor(const std::vector<const NNOu
 	return t;
 }
 
-std::vector<NNOutputData> UtilityNN::buildOutput(const tensorflow::Tensor& policyTensor, const tensorflow::Tensor& valueTensor)
+std::vector<NNOutputData> UtilityNN::buildOutput(const float* policy, const float* value, int rows)
 {	
-	int rows = policyTensor.tensor<float, 2>().dimension(0);
 	std::vector<NNOutputData> output(rows);
-
-	for (int i = 0; i < rows; i++)
+	for (int i = 0; i < rows; i++, policy += TF_OUTPUT_POLICY_TENSOR_SIZE, value += TF_OUTPUT_VALUE_TENSOR_SIZE)
 	{
-		output[i].policy.reserve(TF_OUTPUT_POLICY_TENSOR_SIZE);
-		for (int j = 0; j < TF_OUTPUT_POLICY_TENSOR_SIZE; j++)
-		{
-			float pVal = policyTensor.tensor<float, 2>()(i, j);
-			output[i].policy.push_back(pVal);
-		}
-		output[i].value = valueTensor.tensor<float, 2>()(i, 0);
+		output[i].policy.assign(policy, policy + TF_OUTPUT_POLICY_TENSOR_SIZE);
+		output[i].value = *value;
 	}
 
 	return output;
@@ -169,27 +123,39 @@ std::vector<NNOutputData> UtilityNN::buildOutput(const tensorflow::Tensor& polic
 
 
 
-AlphaZeroNN::AlphaZeroNN()
+AlphaZeroNN::AlphaZeroNN() : version(NNEvaluationCache::newVersion())
 {
 #ifndef _DEBUG
 	tensorflow::SessionOptions opts;
 	opts.config.mutable_gpu_options()->set_allow_growth(true);
 	this->session.reset(tensorflow::NewSession(opts));
 #endif
+	for (int i = 0; i < PIPELINE_SLOTS; i++)
+	{
+		freeSlots.push(i);
+	}
 }
 
 void AlphaZeroNN::initWeights()
 {
 	std::lock_guard<std::mutex> guard(lock);
 #ifndef _DEBUG
-	TF_CHECK_OK(session->Run({}, {}, { TF_OP_INIT }, nullptr));
+	if (hasModel)
+	{
+		TF_CHECK_OK(session->Run({}, {}, { TF_OP_INIT }, nullptr));
+	}
 #endif
+	version = NNEvaluationCache::newVersion();
 }
 
 void AlphaZeroNN::loadCheckpoint(std::string filePath)
 {	
 #ifndef _DEBUG
-	if (std::filesystem::exists(filePath + ".index"))
+	if (!hasModel)
+	{
+		printf("NN without model ignores checkpoint '%s'\n", filePath.c_str());
+	}
+	else if (std::filesystem::exists(filePath + ".index"))
 	{
 		std::lock_guard<std::mutex> guard(lock);
 		TF_CHECK_OK(session->Run({ { TF_INPUT_FILE, UtilityNN::buildTensor(filePath)} }, {}, { TF_OP_RESTORE }, nullptr));
@@ -201,122 +167,313 @@ void AlphaZeroNN::loadCheckpoint(std::string filePath)
 		saveCheckpoint(filePath);		
 	}
 #endif
+	backend->loadWeights();
+	version = NNEvaluationCache::newVersion(); // Only after backend runs new weights, so evaluations of old weights are never cached under new version
 }
 
 void AlphaZeroNN::saveCheckpoint(std::string filePath)
 {
 	std::lock_guard<std::mutex> guard(lock);
 #ifndef _DEBUG	
+	if (!hasModel)
+	{
+		return;
+	}
 	std::string dir = filePath.substr(0, filePath.find_last_of("/\\") + 1);
 	std::filesystem::create_directories(dir);
 	TF_CHECK_OK(session->Run({ { TF_INPUT_FILE, UtilityNN::buildTensor(filePath)} }, {}, { TF_OP_SAVE }, nullptr));
 #endif
 }
 
-void AlphaZeroNN::loadGraph(std::string filePath, std::string device)
+void AlphaZeroNN::loadGraph(std::string filePath, std::string device, std::string backendName)
 {	
 	std::lock_guard<std::mutex> guard(lock);
 #ifndef _DEBUG
-	TF_CHECK_OK(tensorflow::ReadBinaryProto(tensorflow::Env::Default(), filePath, &graph_def));	
-	
-	//tensorflow::graph::SetDefaultDevice(device, &this->graph_def);
-	for (int i = 0; i < graph_def.node_size(); ++i) 
+	if (InferenceBackend::needsModel(backendName))
 	{
-		auto node = graph_def.mutable_node(i);
-		if (node->device() == "/device:GPU:0")
+		TF_CHECK_OK(tensorflow::ReadBinaryProto(tensorflow::Env::Default(), filePath, &graph_def));	
+	
+		//tensorflow::graph::SetDefaultDevice(device, &this->graph_def);
+		for (int i = 0; i < graph_def.node_size(); ++i) 
 		{
-			node->set_device(device);
+			auto node = graph_def.mutable_node(i);
+			if (node->device() == "/device:GPU:0")
+			{
+				node->set_device(device);
+			}
 		}
-	}
 
-	TF_CHECK_OK(session->Create(graph_def));
+		TF_CHECK_OK(session->Create(graph_def));
+		hasModel = true;
+	}
 #endif	
+	backend = InferenceBackend::create(backendName, PIPELINE_SLOTS + 1, session.get(), graph_def);
 }
 
-int AlphaZeroNN::processBatchPrediction()
+void PredictionRequestQueue::push(PredictionRequest* request)
 {
-	{ // Sweep queue, shorten lock time
-		std::lock_guard<std::mutex> guard(lock);
-		predictionsQueueAccepting.swap(predictionsQueueProcessing);
+	request->next = head.load(std::memory_order_relaxed);
+	while (!head.compare_exchange_weak(request->next, request, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void PredictionRequestQueue::takeAll(std::deque<std::unique_ptr<PredictionRequest>>& out)
+{
+	std::vector<PredictionRequest*> taken;
+	for (PredictionRequest* r = head.exchange(nullptr, std::memory_order_acquire); r != nullptr; r = r->next) // Newest first
+	{
+		taken.push_back(r);
+	}
+	for (auto it = taken.rbegin(); it != taken.rend(); it++)
+	{
+		out.push_back(std::unique_ptr<PredictionRequest>(*it));
 	}
-	cvQueueEmpty.notify_one();
-	int samples = predictionsQueueProcessing.size();
+}
 
-#ifndef _DEBUG // Start processing predictionsQueueProcessing
-	std::vector<tensorflow::Tensor> outTensors;
-	TF_CHECK_OK(session->Run({ {TF_INPUT_STATE, UtilityNN::buildInsFutureTensor(predictionsQueueProcessing) }, {TF_INPUT_TRAINING, FALSE_TENSOR} },
-		{ TF_OUTPUT_POLICY, TF_OUTPUT_VALUE }, {}, &outTensors));
+int BatchHistograms::getBucket(uint64_t value)
+{
+	return __MIN(BATCH_HISTOGRAM_BUCKETS - 1, (int)std::bit_width(value));
+}
 
-	tensorflow::Tensor policyTensor = outTensors[0];
-	tensorflow::Tensor valueTensor = outTensors[1];
+void BatchHistograms::write(std::ostream& os)
+{
+	os << batches;
+	for (uint64_t count : batchSize)
+	{
+		os << ", " << count;
+	}
+	for (uint64_t count : queueWaitUs)
+	{
+		os << ", " << count;
+	}
+	os << std::endl;
+}
 
-	std::vector<NNOutputData> outs = UtilityNN::buildOutput(policyTensor, valueTensor);
+void BatchHistograms::reset()
+{
+	*this = BatchHistograms();
+}
 
-	for (int i = 0; i < samples; i++)
+void SlotChannel::push(int slot)
+{
 	{
-		predictionsQueueProcessing[i].promise.set_value(outs[i]);
+		std::lock_guard<std::mutex> guard(lock);
+		slots.push_back(slot);
 	}
-#else
-	for (auto& it : predictionsQueueProcessing)
+	cv.notify_one();
+}
+
+int SlotChannel::pop()
+{
+	std::unique_lock ul(lock);
+	cv.wait(ul, [this] { return !slots.empty(); });
+	int slot = slots.front();
+	slots.pop_front();
+	return slot;
+}
+
+void AlphaZeroNN::encodeBatch()
+{
+	int s = freeSlots.pop(); // Blocks while all slots are in flight, back pressure for slow network
+	BatchSlot& slot = slots[s];
+	waitQueueToFill(slot.predictions);
+
+	UtilityNN::fillInsFuture(backend->getInput(s, slot.predictions.size()), slot.predictions);
+
+	if (SETTINGS.NN_BATCH_LOG_INTERVAL > 0 && histograms.batches >= SETTINGS.NN_BATCH_LOG_INTERVAL)
 	{
-		it.promise.set_value(NNOutputData::createRandom());
+		histograms.write(LOG.getNNBatchLog());
+		histograms.reset();
 	}
-#endif // !_DEBUG
-	predictionsQueueProcessing.clear();
+	encodedSlots.push(s);
+}
+
+int AlphaZeroNN::waitBatchEncoded()
+{
+	return encodedSlots.pop();
+}
+
+int AlphaZeroNN::runBatch(int s)
+{
+	BatchSlot& slot = slots[s];
+	int samples = slot.predictions.size();
+	backend->run(s, samples);
+	ranSlots.push(s);
 	return samples;
 }
 
+void AlphaZeroNN::deliverBatch()
+{
+	int s = ranSlots.pop();
+	BatchSlot& slot = slots[s];
+	int samples = slot.predictions.size();
+	std::vector<NNOutputData> outs = UtilityNN::buildOutput(backend->getPolicy(s), backend->getValue(s), samples);
+
+	std::vector<std::coroutine_handle<>> resume;
+	for (int i = 0; i < samples; i++)
+	{
+		FuturePrediction& fp = slot.predictions[i];
+		NNEvaluationCache::getInstance().put(fp.hash, fp.version, outs[i]);
+		if (fp.awaiter != nullptr)
+		{
+			fp.awaiter->outs[fp.index] = std::move(outs[i]);
+			if (--fp.awaiter->pending == 0)
+			{
+				resume.push_back(fp.awaiter->handle);
+			}
+		}
+		else
+		{
+			fp.promise.set_value(outs[i]);
+		}
+	}
+	MCTSScheduler::getInstance().schedule(resume); // Resume whole batch at once
+
+	slot.predictions.clear();
+	freeSlots.push(s);
+}
+
 std::future<NNOutputData> AlphaZeroNN::predictFuture(const NNInputData& state)
 {
-	std::future<NNOutputData> f;
+	uint64_t hash = state.getCanonicalHash();
+	uint64_t v = version;
+
+	NNOutputData cached;
+	if (NNEvaluationCache::getInstance().get(hash, v, cached))
 	{
-		std::unique_lock ul(lock);
-		cvQueueEmpty.wait(ul, [this] { return !isQueueFull(); });
-		predictionsQueueAccepting.push_back(FuturePrediction(state));
-		f = predictionsQueueAccepting.back().promise.get_future();	
+		std::promise<NNOutputData> p;
+		p.set_value(std::move(cached));
+		return p.get_future();
 	}
 
-	if (isQueueFull())
+	PredictionRequest* request = new PredictionRequest();
+	request->predictions.push_back(FuturePrediction(state, hash, v));
+	std::future<NNOutputData> f = request->predictions.back().promise.get_future();
+	request->queued = std::chrono::steady_clock::now();
+	requests.push(request);
+	notifyArrival();
+
+	return f;
+}
+
+bool NNPredictionAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+	handle = h;
+	return nn->predictAsync(this); // Coroutine can be resumed before this returns, do not touch awaiter after
+}
+
+bool AlphaZeroNN::predictAsync(NNPredictionAwaiter* awaiter)
+{
+	uint64_t v = version;
+	std::vector<FuturePrediction> missed;
+	for (int i = 0; i < awaiter->ins.size(); i++)
 	{
-		cvQueueFull.notify_one();
+		uint64_t hash = awaiter->ins[i].getCanonicalHash();
+		if (!NNEvaluationCache::getInstance().get(hash, v, awaiter->outs[i]))
+		{
+			missed.push_back(FuturePrediction(awaiter, i, hash, v));
+		}
 	}
-	else 
+
+	if (missed.empty())
 	{
-		cvQueueEmpty.notify_one();
+		return false;
 	}
-	
-	return f;
+	awaiter->pending = missed.size(); // Set before queued, processing thread can finish them right away
+
+	PredictionRequest* request = new PredictionRequest(); // All in same batch
+	request->predictions = std::move(missed);
+	request->lowPriority = awaiter->lowPriority;
+	request->queued = std::chrono::steady_clock::now();
+	requests.push(request);
+	notifyArrival();
+	return true;
+}
+
+void AlphaZeroNN::setVersion(uint64_t version)
+{
+	this->version = version;
 }
 
 void AlphaZeroNN::registerThread()
 {
-	{
-		std::lock_guard guard(lock);
-		registeredThreads++;
-		queueSize = __MAX(1, registeredThreads / 2);
-	}
-	cvQueueEmpty.notify_one();
+	registeredThreads++;
 }
 
 void AlphaZeroNN::unregisterThread()
 {
-	{
-		std::lock_guard guard(lock);
-		registeredThreads--;
-		queueSize = __MAX(1, registeredThreads / 2);
-	}
-	cvQueueFull.notify_one();
+	registeredThreads--;
+	notifyArrival(); // Remaining threads can be all waiting
 }
 
-void AlphaZeroNN::waitQueueToFill()
+/*
+	Producers do not take wait lock, so notification can be missed.
+	Missed one delays batch at most till wake up deadline of batch thread, which is max wait.
+*/
+void AlphaZeroNN::notifyArrival()
 {
-	std::unique_lock ul(lock);
-	cvQueueFull.wait(ul, [this] { return isQueueFull(); });
+	arrivals++;
+	cvArrival.notify_one();
 }
 
-bool AlphaZeroNN::isQueueFull()
+bool AlphaZeroNN::isBatchReady(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point& wakeUp)
 {
-	return predictionsQueueAccepting.size() >= queueSize;
+	std::chrono::microseconds maxWait(SETTINGS.NN_MAX_WAIT_US);
+	if (collected.empty())
+	{
+		wakeUp = now + __MAX(maxWait, std::chrono::microseconds(1000)); // Recheck for missed notification
+		return false;
+	}
+
+	size_t samples = 0;
+	int normalRequests = 0;
+	auto deadline = collected.front()->queued + maxWait * LOW_PRIORITY_WAIT_FACTOR; // Oldest request may be low priority
+	for (auto& r : collected)
+	{
+		samples += r->predictions.size();
+		if (!r->lowPriority && normalRequests++ == 0)
+		{
+			deadline = __MIN(deadline, r->queued + maxWait);
+		}
+	}
+
+	wakeUp = deadline;
+	return samples >= SETTINGS.NN_MAX_BATCH || now >= deadline
+		|| normalRequests >= registeredThreads; // Every search waits, low priority alone runs on idle network
+}
+
+void AlphaZeroNN::waitQueueToFill(std::vector<FuturePrediction>& batch)
+{
+	while (true)
+	{
+		uint64_t seen = arrivals;
+		requests.takeAll(collected);
+
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point wakeUp;
+		if (isBatchReady(now, wakeUp))
+		{
+			break;
+		}
+
+		std::unique_lock ul(waitLock);
+		cvArrival.wait_until(ul, wakeUp, [this, seen] { return arrivals != seen; });
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	while (!collected.empty() && (batch.empty() || batch.size() + collected.front()->predictions.size() <= SETTINGS.NN_MAX_BATCH))
+	{
+		std::unique_ptr<PredictionRequest> r = std::move(collected.front());
+		collected.pop_front();
+
+		uint64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(start - r->queued).count();
+		histograms.queueWaitUs[BatchHistograms::getBucket(waitUs)]++;
+		for (auto& fp : r->predictions)
+		{
+			batch.push_back(std::move(fp));
+		}
+	}
+	histograms.batchSize[BatchHistograms::getBucket(batch.size())]++;
+	histograms.batches++;
 }
 
 std::vector<NNOutputData> AlphaZeroNN::predict(const std::vector<NNInputData>& states)
@@ -332,26 +489,104 @@ std::vector<NNOutputData> AlphaZeroNN::predict(const std::vector<NNInputData>& s
 
 NNOutputData AlphaZeroNN::predict(const NNInputData& state)
 {
+	uint64_t hash = state.getCanonicalHash();
+	uint64_t v = version;
+
+	NNOutputData out;
+	if (NNEvaluationCache::getInstance().get(hash, v, out))
+	{
+		return out;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		state.encode(backend->getInput(SYNC_SLOT, 1));
+		backend->run(SYNC_SLOT, 1);
+		out = UtilityNN::buildOutput(backend->getPolicy(SYNC_SLOT), backend->getValue(SYNC_SLOT), 1)[0];
+	}
+
+	NNEvaluationCache::getInstance().put(hash, v, out);
+	return out;
+}
+
+bool AlphaZeroNN::calibrate(const std::vector<NNInputData>& states)
+{
+	std::vector<float> encoded(states.size() * TF_INPUT_TENSOR_SIZE);
+	for (int i = 0; i < states.size(); i++)
+	{
+		states[i].encode(encoded.data() + i * TF_INPUT_TENSOR_SIZE);
+	}
+
 	std::lock_guard<std::mutex> guard(lock);
-#ifndef _DEBUG
-	std::vector<tensorflow::Tensor> outTensors;
+	if (backend->calibrate(encoded.data(), states.size()))
+	{
+		version = NNEvaluationCache::newVersion();
+		return true;
+	}
+	return false;
+}
 
-	TF_CHECK_OK(session->Run({ {TF_INPUT_STATE, UtilityNN::buildInTensor(state) }, {TF_INPUT_TRAINING, FALSE_TENSOR} },
-		{ TF_OUTPUT_POLICY, TF_OUTPUT_VALUE }, {}, &outTensors));
+BackendError AlphaZeroNN::compareBackend(const std::vector<NNInputData>& states, std::string referenceName)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	std::unique_ptr<InferenceBackend> reference = InferenceBackend::create(referenceName, 1, session.get(), graph_def);
+	reference->loadWeights();
 
-	tensorflow::Tensor policyTensor = outTensors[0];
-	tensorflow::Tensor valueTensor = outTensors[1];
+	int samples = states.size();
+	for (int i = 0; i < samples; i++)
+	{
+		states[i].encode(backend->getInput(SYNC_SLOT, samples) + i * TF_INPUT_TENSOR_SIZE);
+		states[i].encode(reference->getInput(0, samples) + i * TF_INPUT_TENSOR_SIZE);
+	}
+	backend->run(SYNC_SLOT, samples);
+	reference->run(0, samples); // First run also optimizes graph of tf backends, it is not timed
 
-	return UtilityNN::buildOutput(policyTensor, valueTensor)[0];
-#else	
-	return NNOutputData::createRandom();
-#endif
+	BackendError error;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < BACKEND_COMPARE_RUNS; i++)
+	{
+		backend->run(SYNC_SLOT, samples);
+	}
+	auto end = std::chrono::steady_clock::now();
+	error.runUs = std::chrono::duration<float, std::micro>(end - start).count() / BACKEND_COMPARE_RUNS;
+	for (int i = 0; i < BACKEND_COMPARE_RUNS; i++)
+	{
+		reference->run(0, samples);
+	}
+	error.referenceRunUs = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - end).count() / BACKEND_COMPARE_RUNS;
+
+	const float* policy = backend->getPolicy(SYNC_SLOT);
+	const float* referencePolicy = reference->getPolicy(0);
+	for (int i = 0; i < samples * TF_OUTPUT_POLICY_TENSOR_SIZE; i++)
+	{
+		error.maxPolicy = __MAX(error.maxPolicy, std::abs(policy[i] - referencePolicy[i]));
+		if (referencePolicy[i] > 0.0f)
+		{
+			error.policyKL += referencePolicy[i] * std::log(referencePolicy[i] / __MAX(policy[i], POLICY_KL_EPSILON));
+		}
+	}
+	const float* value = backend->getValue(SYNC_SLOT);
+	const float* referenceValue = reference->getValue(0);
+	for (int i = 0; i < samples * TF_OUTPUT_VALUE_TENSOR_SIZE; i++)
+	{
+		float difference = value[i] - referenceValue[i];
+		error.maxValue = __MAX(error.maxValue, std::abs(difference));
+		error.valueMSE += difference * difference;
+	}
+	error.policyKL /= samples;
+	error.valueMSE /= samples * TF_OUTPUT_VALUE_TENSOR_SIZE;
+	return error;
 }
 
 void AlphaZeroNN::train(const std::vector<NNTrainData>& trainData, int epochs)
 {
 	std::lock_guard<std::mutex> guard(lock);
 #ifndef _DEBUG
+	if (!hasModel)
+	{
+		throw std::runtime_error("NN without model can not be trained");
+	}
+
 	std::vector<const NNTrainData*> shuffleTrainData(trainData.size());
 	std::vector<const NNInputData*> input(SETTINGS.BATCH_SIZE);
 	std::vector<const NNOutputData*> output(SETTINGS.BATCH_SIZE);
@@ -407,6 +642,8 @@ void AlphaZeroNN::train(const std::vector<NNTrainData>& trainData, int epochs)
 	}
 	if (SETTINGS.LOG_NN_TRAINING) LOG.getNNTrainingLog() << std::endl;
 #endif
+	backend->loadWeights();
+	version = NNEvaluationCache::newVersion(); // Backend runs old weights till loaded
 }
 
 void AlphaZeroNN::trainCrossValidation(const std::vector<NNTrainData>& trainData, int k)
@@ -9,6 +9,10 @@
 #include <filesystem>
 #include <future>
 #include <string>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <ostream>
 
 #include "tensorflow/cc/ops/standard_ops.h"
 #include "tensorflow/core/framework/graph.pb.h"
@@ -26,6 +30,9 @@
 
 
 #include "alphazero_nn_data.h"
+#include "alphazero_nn_cache.h"
+#include "inference_backend.h"
+#include "../alphazero_scheduler.h"
 
 static const std::string TF_INPUT_STATE = "input_state";
 static const std::string TF_INPUT_TRAINING = "input_training";
@@ -46,14 +53,106 @@ static const std::string TF_INPUT_FILE = "save/Const";
 static const std::string TF_OP_RESTORE = "save/restore_all";
 static const std::string TF_OP_SAVE = "save/control_dependency";
 
+static const int LOW_PRIORITY_WAIT_FACTOR = 4; // Low priority requests alone wait this many max waits, unless network is idle
+static const int BATCH_HISTOGRAM_BUCKETS = 16; // Log2 buckets, last one holds everything larger
+static const int PIPELINE_SLOTS = 3; // Batches in flight, one for each stage of encode, run and deliver
+static const int SYNC_SLOT = PIPELINE_SLOTS; // Backend slot of blocking predict
+static const float POLICY_KL_EPSILON = 1e-8f; // Floor of probabilities in policy KL, softmax can underflow to zero
+static const int BACKEND_COMPARE_RUNS = 20; // Timed runs of compared batch on each backend, after first run
+
+
+class AlphaZeroNN;
+
+class NNPredictionAwaiter // Awaitable predictions, coroutine is resumed on MCTSScheduler when all of them are processed
+{
+public:
+	AlphaZeroNN* nn;
+	std::vector<NNInputData> ins;
+	std::vector<NNOutputData> outs;
+	int pending; // Only changed by batch processing thread
+	bool lowPriority; // Does not fill batch, waits for other requests or idle network
+	std::coroutine_handle<> handle;
+
+	NNPredictionAwaiter(AlphaZeroNN* nn, std::vector<NNInputData> ins, bool lowPriority) : nn(nn), ins(std::move(ins)), outs(this->ins.size()), pending(this->ins.size()), lowPriority(lowPriority) {};
+
+	bool await_ready() { return ins.empty(); }
+	bool await_suspend(std::coroutine_handle<> h); // Does not suspend when all predictions are cached
+	std::vector<NNOutputData> await_resume() { return std::move(outs); }
+};
 
 class FuturePrediction
 {
 public:
 	NNInputData in;
 	std::promise<NNOutputData> promise;
+	NNPredictionAwaiter* awaiter = nullptr;
+	int index = 0; // Position of prediction in awaiter
+
+	uint64_t hash; // Cache key of input
+	uint64_t version; // Network version at request time
+
+	FuturePrediction(NNInputData in, uint64_t hash, uint64_t version) : in(in), hash(hash), version(version) {};
+	FuturePrediction(NNPredictionAwaiter* awaiter, int index, uint64_t hash, uint64_t version) : in(awaiter->ins[index]), awaiter(awaiter), index(index), hash(hash), version(version) {};
+};
+
+class PredictionRequest // Predictions of one awaiter or future, node of request queue
+{
+public:
+	PredictionRequest* next = nullptr;
+	std::vector<FuturePrediction> predictions;
+	bool lowPriority = false;
+	std::chrono::steady_clock::time_point queued;
+};
+
+class PredictionRequestQueue // Lock free multi producer single consumer
+{
+private:
+	std::atomic<PredictionRequest*> head = nullptr;
+
+public:
+	void push(PredictionRequest* request); // Thread safe, never blocks
+	void takeAll(std::deque<std::unique_ptr<PredictionRequest>>& out); // Single consumer, appends oldest first
+};
+
+class BatchHistograms // Only used by batch processing thread
+{
+public:
+	uint64_t batches = 0;
+	uint64_t batchSize[BATCH_HISTOGRAM_BUCKETS] = {}; // Bucket i holds sizes below 2^i
+	uint64_t queueWaitUs[BATCH_HISTOGRAM_BUCKETS] = {};
 
-	FuturePrediction(NNInputData in) : in(in) {};
+	static int getBucket(uint64_t value);
+	void write(std::ostream& os); // CSV line, batches, batch size buckets, queue wait buckets
+	void reset();
+};
+
+class BatchSlot // Batch in inference pipeline, buffers are in backend slot of same index
+{
+public:
+	std::vector<FuturePrediction> predictions;
+};
+
+class BackendError // Outputs of backend compared to reference backend on same positions
+{
+public:
+	float maxPolicy = 0.0f; // Max absolute difference
+	float maxValue = 0.0f;
+	float policyKL = 0.0f; // Mean KL divergence of backend policy from reference policy
+	float valueMSE = 0.0f;
+	float runUs = 0.0f; // Mean run time of whole batch, without first run
+	float referenceRunUs = 0.0f;
+};
+
+class SlotChannel // Hands batch slots to next pipeline stage
+{
+private:
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<int> slots;
+
+public:
+	void push(int slot); // Thread safe
+	int pop(); // Thread safe, blocks till slot is available
 };
 
 namespace UtilityNN 
@@ -66,7 +165,7 @@ namespace UtilityNN
 
 	tensorflow::Tensor buildInTensor(const NNInputData& value);
 	tensorflow::Tensor buildInsTensor(const std::vector<const NNInputData*>& value);
-	tensorflow::Tensor buildInsFutureTensor(const std::vector<FuturePrediction>& values);
+	void fillInsFuture(float* out, const std::vector<FuturePrediction>& values); // Buffer must have row for every value
 
 	tensorflow::Tensor buildOutPolicyTensor(const NNOutputData& value);
 	tensorflow::Tensor buildOutsPolicyTensor(const std::vector<const NNOutputData*>& value);
@@ -74,7 +173,7 @@ namespace UtilityNN
 	tensorflow::Tensor buildOutValueTensor(const NNOutputData& value);
 	tensorflow::Tensor buildOutsValueTensor(const std::vector<const NNOutputData*>& value);
 
-	std::vector<NNOutputData> buildOutput(const tensorflow::Tensor& policy, const tensorflow::Tensor& value);
+	std::vector<NNOutputData> buildOutput(const float* policy, const float* value, int rows);
 }
 
 static tensorflow::Tensor TRUE_TENSOR = UtilityNN::buildTensor(true);
@@ -87,17 +186,31 @@ static tensorflow::Tensor FALSE_TENSOR = UtilityNN::buildTensor(false);
 class AlphaZeroNN
 {
 private:
-	std::mutex lock;
-	std::condition_variable cvQueueFull;
-	std::condition_variable cvQueueEmpty;
+	std::mutex lock; // Session in use
 	
 	std::unique_ptr<tensorflow::Session> session;
 	tensorflow::GraphDef graph_def;
+	std::unique_ptr<InferenceBackend> backend; // Runs predictions, session is used for training
+	bool hasModel = false; // Graph is loaded to session, synthetic backend runs without it
 	
-	int registeredThreads = 0;
-	int queueSize = 1;
-	std::vector<FuturePrediction> predictionsQueueAccepting;
-	std::vector<FuturePrediction> predictionsQueueProcessing;
+	std::atomic<uint64_t> version; // Changes with weights, part of evaluation cache key
+
+	std::atomic<int> registeredThreads = 0; // Each has at most one request in flight
+	PredictionRequestQueue requests;
+	std::atomic<uint64_t> arrivals = 0;
+	std::mutex waitLock; // Only taken by batch thread, producers notify without it
+	std::condition_variable cvArrival;
+
+	std::deque<std::unique_ptr<PredictionRequest>> collected; // Taken from queue, waiting for batch
+	BatchHistograms histograms; // Only used by encode stage
+
+	BatchSlot slots[PIPELINE_SLOTS];
+	SlotChannel freeSlots;
+	SlotChannel encodedSlots;
+	SlotChannel ranSlots;
+
+	void notifyArrival();
+	bool isBatchReady(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point& wakeUp);
 	
 public:
 	AlphaZeroNN();
@@ -105,19 +218,26 @@ public:
 	void initWeights();
 	void loadCheckpoint(std::string filePath);
 	void saveCheckpoint(std::string filePath);
-	void loadGraph(std::string filePath, std::string device);
+	void loadGraph(std::string filePath, std::string device, std::string backendName);
 	
-	void waitQueueToFill();
-	bool isQueueFull();
-
-	std::future<NNOutputData> predictFuture(const NNInputData& state); // Thread safe
-	int processBatchPrediction();
+	void waitQueueToFill(std::vector<FuturePrediction>& batch); // Batch is taken at max batch, max wait of oldest request or when every registered thread waits
+
+	std::future<NNOutputData> predictFuture(const NNInputData& state); // Thread safe, never blocks caller
+	bool predictAsync(NNPredictionAwaiter* awaiter); // Thread safe, never blocks caller, returns false when all predictions were cached
+	// Inference pipeline, each stage runs on own thread so batches are encoded and delivered while other batch runs
+	void encodeBatch(); // Waits for requests, encodes batch to free slot
+	int waitBatchEncoded(); // Returns slot of next encoded batch
+	int runBatch(int slot); // Caller holds device, returns samples
+	void deliverBatch(); // Caches outputs and resumes waiting searches
 		
 	NNOutputData predict(const NNInputData& state);
 	std::vector<NNOutputData> predict(const std::vector<NNInputData>& states);
 	void train(const std::vector<NNTrainData>& trainData, int epochs);
 	void trainCrossValidation(const std::vector<NNTrainData>& trainData, int k);
+	bool calibrate(const std::vector<NNInputData>& states); // Activation ranges of quantized backend, true when outputs changed
+	BackendError compareBackend(const std::vector<NNInputData>& states, std::string referenceName); // Reference backend runs same weights
 
+	void setVersion(uint64_t version); // Networks with same weights share version
 	void registerThread(); // Tell NN prediction batch to wait for thread
 	void unregisterThread(); // Tell NN prediction batch to stop waiting for thread
 };
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "alphazero_nn_cache.h"
+
+NNEvaluationCache::NNEvaluationCache(size_t memoryMB)
+{
+	shardCapacity = memoryMB * 1024 * 1024 / getEntryBytes() / NN_CACHE_SHARDS;
+	if (shardCapacity > 0)
+	{
+		printf("NN evaluation cache with %d entries (%d MB)\n", int(shardCapacity * NN_CACHE_SHARDS), int(memoryMB));
+	}
+}
+
+size_t NNEvaluationCache::getKey(uint64_t hash, uint64_t version)
+{
+	return hash ^ (version * 0x9E3779B97F4A7C15ULL);
+}
+
+/*
+	Approximate memory of entry, list node, index node and policy vector
+*/
+size_t NNEvaluationCache::getEntryBytes()
+{
+	return sizeof(Entry) + 2 * sizeof(void*) + sizeof(std::pair<uint64_t, std::list<Entry>::iterator>) + 2 * sizeof(void*) + TF_OUTPUT_POLICY_TENSOR_SIZE * sizeof(float);
+}
+
+bool NNEvaluationCache::isEnabled()
+{
+	return shardCapacity > 0;
+}
+
+bool NNEvaluationCache::get(uint64_t hash, uint64_t version, NNOutputData& out)
+{
+	if (!isEnabled())
+	{
+		return false;
+	}
+
+	size_t key = getKey(hash, version);
+	Shard& s = shards[key % NN_CACHE_SHARDS];
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		auto it = s.index.find(key);
+		if (it != s.index.end() && it->second->hash == hash && it->second->version == version)
+		{
+			s.lru.splice(s.lru.begin(), s.lru, it->second); // Mark as most recently used
+			out = it->second->out;
+			hits++;
+			return true;
+		}
+	}
+	misses++;
+	return false;
+}
+
+void NNEvaluationCache::put(uint64_t hash, uint64_t version, const NNOutputData& out)
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+
+	size_t key = getKey(hash, version);
+	Shard& s = shards[key % NN_CACHE_SHARDS];
+
+	std::lock_guard<std::mutex> guard(s.lock);
+	auto it = s.index.find(key);
+	if (it != s.index.end())
+	{
+		s.lru.erase(it->second);
+		s.index.erase(it);
+	}
+
+	s.lru.push_front({ hash, version, out });
+	s.index[key] = s.lru.begin();
+
+	while (s.lru.size() > shardCapacity)
+	{
+		s.index.erase(getKey(s.lru.back().hash, s.lru.back().version));
+		s.lru.pop_back();
+		evictions++;
+	}
+}
+
+size_t NNEvaluationCache::size()
+{
+	size_t total = 0;
+	for (auto& s : shards)
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		total += s.lru.size();
+	}
+	return total;
+}
+
+void NNEvaluationCache::logStats()
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+
+	uint64_t h = hits.exchange(0);
+	uint64_t m = misses.exchange(0);
+	uint64_t e = evictions.exchange(0);
+	size_t entries = size();
+
+	printf("NN cache hit rate %.3f (%llu/%llu), entries %d (%.1f MB), evictions %llu\n",
+		h + m > 0 ? double(h) / (h + m) : 0.0, (unsigned long long)h, (unsigned long long)(h + m),
+		int(entries), double(entries * getEntryBytes()) / (1024 * 1024), (unsigned long long)e);
+}
+
+uint64_t NNEvaluationCache::newVersion()
+{
+	static std::atomic<uint64_t> VERSION = 0;
+	return ++VERSION;
+}
+
+NNEvaluationCache& NNEvaluationCache::getInstance()
+{
+	static NNEvaluationCache INSTANCE(SETTINGS.NN_CACHE_MB);
+	return INSTANCE;
+}
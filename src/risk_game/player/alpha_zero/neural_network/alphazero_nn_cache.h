@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "alphazero_nn_data.h"
+
+static const int NN_CACHE_SHARDS = 64;
+
+
+/*
+	Network evaluations shared by all games and players. Key is player relative hash of NN input and network version,
+	version changes whenever weights change, so stale entries are never returned and are evicted as least recently used.
+*/
+class NNEvaluationCache // Thread safe class
+{
+private:
+	class Entry
+	{
+	public:
+		uint64_t hash;
+		uint64_t version;
+		NNOutputData out;
+	};
+
+	class Shard
+	{
+	public:
+		std::mutex lock;
+		std::list<Entry> lru; // Most recently used first
+		std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+	};
+
+	Shard shards[NN_CACHE_SHARDS];
+	size_t shardCapacity;
+
+	std::atomic<uint64_t> hits = 0;
+	std::atomic<uint64_t> misses = 0;
+	std::atomic<uint64_t> evictions = 0;
+
+	static size_t getKey(uint64_t hash, uint64_t version);
+
+public:
+	NNEvaluationCache(size_t memoryMB);
+
+	bool isEnabled();
+	bool get(uint64_t hash, uint64_t version, NNOutputData& out);
+	void put(uint64_t hash, uint64_t version, const NNOutputData& out);
+
+	size_t size();
+	static size_t getEntryBytes();
+
+	void logStats(); // Print hit rate and reset counters
+
+	static uint64_t newVersion(); // Unique version for new network weights
+	static NNEvaluationCache& getInstance();
+};
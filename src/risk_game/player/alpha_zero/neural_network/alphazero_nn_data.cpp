@@ -1,5 +1,9 @@
 #include "alphazero_nn_data.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 void NNOutputData::normalize(uint64_t validMoves)
 {
 	float sum = 0.0f;
@@ -89,8 +93,8 @@ void NNTrainDataStorage::loadTrainingSamples(std::string filePath)
 	{
 		std::ifstream in(filePath, std::ios::out | std::ios::binary);
 
-		int size = 0;
-		in.read((char*)&size, sizeof(int));
+		size_t size = 0; // Written as size_t by saveTrainingSamples
+		in.read((char*)&size, sizeof(size_t));
 
 		data.resize(size);
 		for (int i = 0; i < size; i++)
@@ -162,6 +166,109 @@ void NNTrainDataStorage::updateOldGamesIndex()
 	oldGameIndex = data.size() - 1;
 }
 
+uint64_t NNInputData::getCanonicalHash() const
+{
+#if defined(INPUT_VECTOR_TYPE_1) || defined(INPUT_VECTOR_TYPE_2) || defined(INPUT_VECTOR_TYPE_3)
+	uint8_t buffer[DATA_TERRITORY * 2 + sizeof(float) * 10 + sizeof(uint16_t)] = {};
+	int size = 0;
+
+	for (int i = 0; i < DATA_TERRITORY; i++) // Owner relative to player on turn, as seen by network
+	{
+		buffer[size++] = land[i].army;
+		buffer[size++] = land[i].playerIndex == playerIndex ? IF_CURRENT_PLAYER : land[i].playerIndex == NEUTRAL_PLAYER ? IF_NEUTRAL_PLAYER : IF_ENEMY_PLAYER;
+	}
+
+	const float features[] = {
+		featureReinforcementShare, featureAttackFrequency, featureCanDrawCard,
+		featureIsPhaseSetup, featureIsPhaseSetupNeutral, featureIsPhaseReinforcement,
+		featureIsPhaseAttack, featureIsPhaseAttackMobilization, featureIsPhaseFortify,
+#if defined(INPUT_VECTOR_TYPE_2) || defined(INPUT_VECTOR_TYPE_3)
+		featureArmyShare
+#else
+		0.0f
+#endif
+	};
+	memcpy(buffer + size, features, sizeof(features));
+	size += sizeof(features);
+
+#if defined(INPUT_VECTOR_TYPE_3)
+	memcpy(buffer + size, &round, sizeof(round));
+	size += sizeof(round);
+#endif
+
+	return XXH64(buffer, size, 0);
+#else
+	return XXH64(this, sizeof(NNInputData), 0);
+#endif
+}
+
+/*
+	Global features are same in every cell, cell template is copied once per land.
+	With AVX2 army planes of 8 lands are decoded at once, LandArmy byte holds army in low 6 bits and owner in high 2 bits.
+*/
+void NNInputData::encode(float* out) const
+{
+#if defined(INPUT_VECTOR_TYPE_1) || defined(INPUT_VECTOR_TYPE_2) || defined(INPUT_VECTOR_TYPE_3)
+	static_assert(sizeof(LandArmy) == 1 && MAP_X * MAP_Y == DATA_TERRITORY);
+
+	float cell[TF_INPUT_FEATURES] = {};
+	cell[IF_REINFORCEMENT_SHARE] = featureReinforcementShare;
+	cell[IF_ATTACKS_DURING_TURN] = featureAttackFrequency;
+	cell[IF_CAN_DRAW_CARD] = featureCanDrawCard;
+	cell[IF_PHASE_SETUP] = featureIsPhaseSetup;
+	cell[IF_PHASE_SETUP_NEUTRAL] = featureIsPhaseSetupNeutral;
+	cell[IF_PHASE_REINFORCEMENT] = featureIsPhaseReinforcement;
+	cell[IF_PHASE_ATTACK] = featureIsPhaseAttack;
+	cell[IF_PHASE_ATTACK_MOBILIZATION] = featureIsPhaseAttackMobilization;
+	cell[IF_PHASE_FORTIFY] = featureIsPhaseFortify;
+#if defined(INPUT_VECTOR_TYPE_2) || defined(INPUT_VECTOR_TYPE_3)
+	cell[IF_ARMY_SHARE] = featureArmyShare;
+#if defined(INPUT_VECTOR_TYPE_3)
+	cell[IF_ROUND] = float(round) / SETTINGS.MAX_GAME_ROUNDS;
+#endif
+#endif
+
+	uint8_t enemyIndex = playerIndex == 0 ? 1 : 0;
+	alignas(32) float current[DATA_TERRITORY];
+	alignas(32) float enemy[DATA_TERRITORY];
+	alignas(32) float neutral[DATA_TERRITORY];
+
+	int i = 0;
+#ifdef __AVX2__
+	const __m256 scale = _mm256_set1_ps(1.0f / LAND_ARMY_MAX);
+	const __m256i armyMask = _mm256_set1_epi32(0x3F);
+	const __m256i currentOwner = _mm256_set1_epi32(playerIndex);
+	const __m256i enemyOwner = _mm256_set1_epi32(enemyIndex);
+	const __m256i neutralOwner = _mm256_set1_epi32(NEUTRAL_PLAYER);
+	for (; i + 8 <= DATA_TERRITORY; i += 8)
+	{
+		__m256i bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(land + i)));
+		__m256 army = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(bytes, armyMask)), scale);
+		__m256i owner = _mm256_srli_epi32(bytes, 6);
+
+		_mm256_store_ps(current + i, _mm256_and_ps(army, _mm256_castsi256_ps(_mm256_cmpeq_epi32(owner, currentOwner))));
+		_mm256_store_ps(enemy + i, _mm256_and_ps(army, _mm256_castsi256_ps(_mm256_cmpeq_epi32(owner, enemyOwner))));
+		_mm256_store_ps(neutral + i, _mm256_and_ps(army, _mm256_castsi256_ps(_mm256_cmpeq_epi32(owner, neutralOwner))));
+	}
+#endif // __AVX2__
+	for (; i < DATA_TERRITORY; i++)
+	{
+		float army = float(land[i].army) / LAND_ARMY_MAX;
+		current[i] = land[i].playerIndex == playerIndex ? army : 0.0f;
+		enemy[i] = land[i].playerIndex == enemyIndex ? army : 0.0f;
+		neutral[i] = land[i].playerIndex == NEUTRAL_PLAYER ? army : 0.0f;
+	}
+
+	for (i = 0; i < DATA_TERRITORY; i++, out += TF_INPUT_FEATURES)
+	{
+		memcpy(out, cell, sizeof(cell));
+		out[IF_CURRENT_PLAYER] = current[i];
+		out[IF_ENEMY_PLAYER] = enemy[i];
+		out[IF_NEUTRAL_PLAYER] = neutral[i];
+	}
+#endif
+}
+
 NNInputData::NNInputData(const State& s) // (6 * 7) * 4
 {
 	const PlayerStatus* ps = s.getCurrentPlayerStatus();
@@ -93,6 +93,9 @@ public:
 
 	NNInputData() {};
 	NNInputData(const State& s);
+
+	uint64_t getCanonicalHash() const; // Same for positions that differ only in which player is on turn
+	void encode(float* out) const; // Writes TF_INPUT_TENSOR_SIZE floats in input tensor layout, [MAP_Y][MAP_X][TF_INPUT_FEATURES]
 };
 
 class NNOutputData
@@ -0,0 +1,827 @@
+#include "cpu_backend.h"
+
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif // __AVX2__
+
+WorkerPool::WorkerPool(int threads)
+{
+	for (int i = 0; i < threads; i++)
+	{
+		this->threads.push_back(std::thread(&WorkerPool::threadWork, this));
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	cvJob.notify_all();
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+}
+
+void WorkerPool::work(const std::function<void(int)>& job, int tasks)
+{
+	for (int t = nextTask++; t < tasks; t = nextTask++)
+	{
+		job(t);
+	}
+}
+
+void WorkerPool::threadWork()
+{
+	uint64_t seen = 0;
+	while (true)
+	{
+		const std::function<void(int)>* j;
+		int n;
+		{
+			std::unique_lock ul(lock);
+			cvJob.wait(ul, [this, seen] { return stopping || generation != seen; });
+			if (stopping)
+			{
+				return;
+			}
+			seen = generation;
+			j = job;
+			n = tasks;
+		}
+
+		work(*j, n);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (--busyThreads == 0)
+		{
+			cvDone.notify_one();
+		}
+	}
+}
+
+void WorkerPool::run(int tasks, const std::function<void(int)>& job)
+{
+	if (threads.empty() || tasks == 1)
+	{
+		for (int t = 0; t < tasks; t++)
+		{
+			job(t);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		this->job = &job;
+		this->tasks = tasks;
+		nextTask = 0;
+		busyThreads = threads.size();
+		generation++;
+	}
+	cvJob.notify_all();
+
+	work(job, tasks);
+
+	std::unique_lock ul(lock);
+	cvDone.wait(ul, [this] { return busyThreads == 0; }); // Job is owned by caller
+}
+
+void ConvLayer::fold(const float* gamma, const float* beta, const float* mean, const float* variance)
+{
+	std::vector<float> scale(outputs);
+	for (int o = 0; o < outputs; o++)
+	{
+		scale[o] = gamma[o] / std::sqrt(variance[o] + BN_EPSILON);
+		bias[o] = beta[o] + (bias[o] - mean[o]) * scale[o];
+	}
+	for (int i = 0; i < weights.size(); i++)
+	{
+		weights[i] *= scale[i % outputs];
+	}
+}
+
+void ConvLayer::pack()
+{
+	panels.clear();
+	if (outputs % CONV_TILE_OUTPUTS != 0)
+	{
+		return;
+	}
+	for (int o = 0; o < outputs; o += CONV_TILE_OUTPUTS)
+	{
+		for (int i = 0; i < kernel * kernel * inputs; i++)
+		{
+			panels.insert(panels.end(), weights.begin() + i * outputs + o, weights.begin() + i * outputs + o + CONV_TILE_OUTPUTS);
+		}
+	}
+}
+
+bool ConvLayer::quantize(float inputMax)
+{
+	inputScale = 0.0f;
+	quantizedPanels.clear();
+	outputScales.clear();
+	if (inputs % QUANT_GROUP != 0 || outputs % CONV_TILE_OUTPUTS != 0)
+	{
+		return false;
+	}
+
+	std::vector<float> weightScales(outputs, 0.0f);
+	for (int i = 0; i < weights.size(); i++)
+	{
+		weightScales[i % outputs] = __MAX(weightScales[i % outputs], std::abs(weights[i]));
+	}
+	for (float& scale : weightScales)
+	{
+		scale = scale > 0.0f ? scale / QUANT_MAX_WEIGHT : 1.0f;
+	}
+
+	for (int o = 0; o < outputs; o += CONV_TILE_OUTPUTS)
+	{
+		for (int t = 0; t < kernel * kernel; t++)
+		{
+			for (int c = 0; c < inputs; c += QUANT_GROUP)
+			{
+				for (int j = o; j < o + CONV_TILE_OUTPUTS; j++)
+				{
+					for (int g = 0; g < QUANT_GROUP; g++)
+					{
+						quantizedPanels.push_back(int8_t(std::lround(weights[(t * inputs + c + g) * outputs + j] / weightScales[j])));
+					}
+				}
+			}
+		}
+	}
+
+	inputScale = inputMax > 0.0f ? inputMax / QUANT_MAX_ACTIVATION : 1.0f;
+	for (float scale : weightScales)
+	{
+		outputScales.push_back(inputScale * scale);
+	}
+	return true;
+}
+
+void ConvLayer::applyPixel(const float* in, float* out) const
+{
+	std::copy(bias.begin(), bias.end(), out);
+	for (int c = 0; c < inputs; c++)
+	{
+		const float* w = weights.data() + c * outputs;
+		for (int o = 0; o < outputs; o++)
+		{
+			out[o] += in[c] * w[o];
+		}
+	}
+}
+
+void DenseLayer::apply(const float* in, float* out) const
+{
+	std::copy(bias.begin(), bias.end(), out);
+	for (int i = 0; i < inputs; i++)
+	{
+		const float* w = weights.data() + i * outputs;
+		for (int o = 0; o < outputs; o++)
+		{
+			out[o] += in[i] * w[o];
+		}
+	}
+}
+
+void ResidualNetwork::evaluateHeads(const float* tower, float* policy, float* value) const
+{
+	int filters = stem.outputs;
+
+	std::vector<float> features(BOARD_PIXELS * policyConv.outputs);
+	for (int p = 0; p < BOARD_PIXELS; p++)
+	{
+		policyConv.applyPixel(tower + p * filters, features.data() + p * policyConv.outputs);
+	}
+	for (float& f : features)
+	{
+		f = __MAX(f, 0.0f);
+	}
+	policyDense.apply(features.data(), policy);
+
+	float maxLogit = *std::max_element(policy, policy + policyDense.outputs);
+	float sum = 0.0f;
+	for (int i = 0; i < policyDense.outputs; i++)
+	{
+		policy[i] = std::exp(policy[i] - maxLogit);
+		sum += policy[i];
+	}
+	for (int i = 0; i < policyDense.outputs; i++)
+	{
+		policy[i] /= sum;
+	}
+
+	features.resize(BOARD_PIXELS * valueConv.outputs);
+	for (int p = 0; p < BOARD_PIXELS; p++)
+	{
+		valueConv.applyPixel(tower + p * filters, features.data() + p * valueConv.outputs);
+	}
+	for (float& f : features)
+	{
+		f = __MAX(f, 0.0f);
+	}
+	std::vector<float> hidden(valueHidden.outputs);
+	valueHidden.apply(features.data(), hidden.data());
+	for (float& h : hidden)
+	{
+		h = __MAX(h, 0.0f);
+	}
+	valueDense.apply(hidden.data(), value);
+	value[0] = std::tanh(value[0]);
+}
+
+std::shared_ptr<ResidualNetwork> ResidualNetwork::createRandom(int filters, int blocks)
+{
+	std::default_random_engine engine(CPU_DEBUG_SEED);
+	auto randomConv = [&engine](int kernel, int inputs, int outputs)
+	{
+		std::uniform_real_distribution<float> weight(-1.0f, 1.0f);
+		float range = std::sqrt(3.0f / (kernel * kernel * inputs)); // Keeps activation variance through tower
+
+		ConvLayer layer;
+		layer.kernel = kernel;
+		layer.inputs = inputs;
+		layer.outputs = outputs;
+		layer.weights.resize(kernel * kernel * inputs * outputs);
+		for (float& w : layer.weights)
+		{
+			w = weight(engine) * range;
+		}
+		layer.bias.resize(outputs);
+		for (float& b : layer.bias)
+		{
+			b = weight(engine) * 0.1f;
+		}
+		layer.pack();
+		return layer;
+	};
+	auto randomDense = [&randomConv](int inputs, int outputs)
+	{
+		ConvLayer conv = randomConv(1, inputs, outputs);
+
+		DenseLayer layer;
+		layer.inputs = inputs;
+		layer.outputs = outputs;
+		layer.weights = std::move(conv.weights);
+		layer.bias = std::move(conv.bias);
+		return layer;
+	};
+
+	std::shared_ptr<ResidualNetwork> net(new ResidualNetwork());
+	net->stem = randomConv(3, TF_INPUT_FEATURES, filters);
+	net->stemRowScale.assign(MAP_Y, 1.0f);
+	net->stemRowShift.assign(MAP_Y, 0.0f);
+	for (int i = 0; i < 2 * blocks; i++)
+	{
+		net->blocks.push_back(randomConv(3, filters, filters));
+	}
+	net->policyConv = randomConv(1, filters, 2);
+	net->policyDense = randomDense(BOARD_PIXELS * 2, TF_OUTPUT_POLICY_TENSOR_SIZE);
+	net->valueConv = randomConv(1, filters, 1);
+	net->valueHidden = randomDense(BOARD_PIXELS, CPU_DEBUG_VALUE_HIDDEN);
+	net->valueDense = randomDense(CPU_DEBUG_VALUE_HIDDEN, TF_OUTPUT_VALUE_TENSOR_SIZE);
+	return net;
+}
+
+#ifdef __AVX2__
+static inline __m256 multiplyAdd(__m256 a, __m256 b, __m256 c)
+{
+#ifdef __FMA__
+	return _mm256_fmadd_ps(a, b, c);
+#else
+	return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif // __FMA__
+}
+
+template<int PIXELS>
+static void convolveTileAVX2(const ConvLayer& layer, const float* const rows[][CONV_TILE_PIXELS], int from, float* out, const float* residual, bool relu)
+{
+	__m256 acc[PIXELS][2];
+	for (int r = 0; r < PIXELS; r++)
+	{
+		acc[r][0] = _mm256_loadu_ps(layer.bias.data() + from);
+		acc[r][1] = _mm256_loadu_ps(layer.bias.data() + from + 8);
+	}
+
+	int taps = layer.kernel * layer.kernel;
+	const float* w = layer.panels.data() + (from / CONV_TILE_OUTPUTS) * taps * layer.inputs * CONV_TILE_OUTPUTS;
+	for (int t = 0; t < taps; t++)
+	{
+		const float* const* in = rows[t];
+		for (int c = 0; c < layer.inputs; c++, w += CONV_TILE_OUTPUTS)
+		{
+			__m256 w0 = _mm256_loadu_ps(w);
+			__m256 w1 = _mm256_loadu_ps(w + 8);
+			for (int r = 0; r < PIXELS; r++)
+			{
+				__m256 a = _mm256_broadcast_ss(in[r] + c);
+				acc[r][0] = multiplyAdd(a, w0, acc[r][0]);
+				acc[r][1] = multiplyAdd(a, w1, acc[r][1]);
+			}
+		}
+	}
+
+	for (int r = 0; r < PIXELS; r++)
+	{
+		for (int h = 0; h < 2; h++)
+		{
+			int i = r * layer.outputs + from + h * 8;
+			__m256 v = acc[r][h];
+			if (residual != nullptr)
+			{
+				v = _mm256_add_ps(v, _mm256_loadu_ps(residual + i));
+			}
+			if (relu)
+			{
+				v = _mm256_max_ps(v, _mm256_setzero_ps());
+			}
+			_mm256_storeu_ps(out + i, v);
+		}
+	}
+}
+inline __m256i dotAdd(__m256i acc, __m256i a, __m256i w) // Adds products of four unsigned inputs and signed weights to each 32 bit lane
+{
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+	return _mm256_dpbusd_epi32(acc, a, w);
+#else
+	__m256i pairs = _mm256_maddubs_epi16(a, w);
+	return _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, _mm256_set1_epi16(1)));
+#endif // __AVX512VNNI__ && __AVX512VL__
+}
+
+template<int PIXELS>
+static void convolveTileQuantizedAVX2(const ConvLayer& layer, const uint8_t* const rows[][CONV_TILE_PIXELS], int from, float* out, const float* residual, bool relu)
+{
+	__m256i acc[PIXELS][2];
+	for (int r = 0; r < PIXELS; r++)
+	{
+		acc[r][0] = _mm256_setzero_si256();
+		acc[r][1] = _mm256_setzero_si256();
+	}
+
+	int taps = layer.kernel * layer.kernel;
+	const int8_t* w = layer.quantizedPanels.data() + (from / CONV_TILE_OUTPUTS) * taps * layer.inputs * CONV_TILE_OUTPUTS;
+	for (int t = 0; t < taps; t++)
+	{
+		const uint8_t* const* in = rows[t];
+		for (int c = 0; c < layer.inputs; c += QUANT_GROUP, w += QUANT_GROUP * CONV_TILE_OUTPUTS)
+		{
+			__m256i w0 = _mm256_loadu_si256((const __m256i*)w);
+			__m256i w1 = _mm256_loadu_si256((const __m256i*)(w + 32));
+			for (int r = 0; r < PIXELS; r++)
+			{
+				int32_t group;
+				std::memcpy(&group, in[r] + c, QUANT_GROUP);
+				__m256i a = _mm256_set1_epi32(group);
+				acc[r][0] = dotAdd(acc[r][0], a, w0);
+				acc[r][1] = dotAdd(acc[r][1], a, w1);
+			}
+		}
+	}
+
+	for (int r = 0; r < PIXELS; r++)
+	{
+		for (int h = 0; h < 2; h++)
+		{
+			int i = r * layer.outputs + from + h * 8;
+			__m256 v = multiplyAdd(_mm256_cvtepi32_ps(acc[r][h]), _mm256_loadu_ps(layer.outputScales.data() + from + h * 8), _mm256_loadu_ps(layer.bias.data() + from + h * 8));
+			if (residual != nullptr)
+			{
+				v = _mm256_add_ps(v, _mm256_loadu_ps(residual + i));
+			}
+			if (relu)
+			{
+				v = _mm256_max_ps(v, _mm256_setzero_ps());
+			}
+			_mm256_storeu_ps(out + i, v);
+		}
+	}
+}
+#endif // __AVX2__
+
+/*
+	Outputs [from, to) of count pixels, rows holds input pixel of each kernel tap, out and residual point to first pixel of tile
+*/
+static void convolveTile(const ConvLayer& layer, const float* const rows[][CONV_TILE_PIXELS], int count, int from, int to, float* out, const float* residual, bool relu)
+{
+#ifdef __AVX2__
+	if (!layer.panels.empty()) // Range is one panel
+	{
+		switch (count)
+		{
+		case 1: convolveTileAVX2<1>(layer, rows, from, out, residual, relu); return;
+		case 2: convolveTileAVX2<2>(layer, rows, from, out, residual, relu); return;
+		case 3: convolveTileAVX2<3>(layer, rows, from, out, residual, relu); return;
+		case 4: convolveTileAVX2<4>(layer, rows, from, out, residual, relu); return;
+		case 5: convolveTileAVX2<5>(layer, rows, from, out, residual, relu); return;
+		case 6: convolveTileAVX2<6>(layer, rows, from, out, residual, relu); return;
+		}
+	}
+#endif // __AVX2__
+
+	int taps = layer.kernel * layer.kernel;
+	for (int r = 0; r < count; r++)
+	{
+		std::copy(layer.bias.begin() + from, layer.bias.begin() + to, out + r * layer.outputs + from);
+	}
+	for (int t = 0; t < taps; t++)
+	{
+		for (int c = 0; c < layer.inputs; c++)
+		{
+			const float* w = layer.weights.data() + (t * layer.inputs + c) * layer.outputs;
+			for (int r = 0; r < count; r++)
+			{
+				float a = rows[t][r][c];
+				float* o = out + r * layer.outputs;
+				for (int j = from; j < to; j++)
+				{
+					o[j] += a * w[j];
+				}
+			}
+		}
+	}
+	for (int r = 0; r < count; r++)
+	{
+		for (int j = from; j < to; j++)
+		{
+			int i = r * layer.outputs + j;
+			float v = residual != nullptr ? out[i] + residual[i] : out[i];
+			out[i] = relu ? __MAX(v, 0.0f) : v;
+		}
+	}
+}
+
+/*
+	Same as convolveTile on 8 bit inputs, range is always one panel
+*/
+static void convolveTileQuantized(const ConvLayer& layer, const uint8_t* const rows[][CONV_TILE_PIXELS], int count, int from, int to, float* out, const float* residual, bool relu)
+{
+#ifdef __AVX2__
+	switch (count)
+	{
+	case 1: convolveTileQuantizedAVX2<1>(layer, rows, from, out, residual, relu); return;
+	case 2: convolveTileQuantizedAVX2<2>(layer, rows, from, out, residual, relu); return;
+	case 3: convolveTileQuantizedAVX2<3>(layer, rows, from, out, residual, relu); return;
+	case 4: convolveTileQuantizedAVX2<4>(layer, rows, from, out, residual, relu); return;
+	case 5: convolveTileQuantizedAVX2<5>(layer, rows, from, out, residual, relu); return;
+	case 6: convolveTileQuantizedAVX2<6>(layer, rows, from, out, residual, relu); return;
+	}
+#endif // __AVX2__
+
+	int32_t acc[CONV_TILE_PIXELS][CONV_TILE_OUTPUTS] = {};
+	int taps = layer.kernel * layer.kernel;
+	const int8_t* w = layer.quantizedPanels.data() + (from / CONV_TILE_OUTPUTS) * taps * layer.inputs * CONV_TILE_OUTPUTS;
+	for (int t = 0; t < taps; t++)
+	{
+		for (int c = 0; c < layer.inputs; c += QUANT_GROUP, w += QUANT_GROUP * CONV_TILE_OUTPUTS)
+		{
+			for (int r = 0; r < count; r++)
+			{
+				const uint8_t* a = rows[t][r] + c;
+				for (int j = 0; j < CONV_TILE_OUTPUTS; j++)
+				{
+					for (int g = 0; g < QUANT_GROUP; g++)
+					{
+						acc[r][j] += a[g] * w[j * QUANT_GROUP + g];
+					}
+				}
+			}
+		}
+	}
+
+	for (int r = 0; r < count; r++)
+	{
+		for (int j = from; j < to; j++)
+		{
+			int i = r * layer.outputs + j;
+			float v = acc[r][j - from] * layer.outputScales[j] + layer.bias[j];
+			v = residual != nullptr ? v + residual[i] : v;
+			out[i] = relu ? __MAX(v, 0.0f) : v;
+		}
+	}
+}
+
+/*
+	Input pixel of each kernel tap for count pixels from first, padding points to zeros
+*/
+template<typename T>
+static void gatherTile(const ConvLayer& layer, const T* in, const T* zeros, int first, int count, const T* rows[][CONV_TILE_PIXELS])
+{
+	int pad = layer.kernel / 2;
+	for (int r = 0; r < count; r++)
+	{
+		int p = first + r;
+		int sample = p / BOARD_PIXELS;
+		int y = (p % BOARD_PIXELS) / MAP_X;
+		int x = p % MAP_X;
+		for (int t = 0; t < layer.kernel * layer.kernel; t++)
+		{
+			int ny = y + t / layer.kernel - pad;
+			int nx = x + t % layer.kernel - pad;
+			bool inside = ny >= 0 && ny < MAP_Y && nx >= 0 && nx < MAP_X;
+			rows[t][r] = inside ? in + (sample * BOARD_PIXELS + ny * MAP_X + nx) * layer.inputs : zeros;
+		}
+	}
+}
+
+CPUBackend::CPUBackend(int slots, tensorflow::Session* session, const tensorflow::GraphDef& graph, bool quantized) : session(session), quantized(quantized), slots(slots), pool(SETTINGS.NN_CPU_THREADS - 1)
+{
+	for (int i = 0; i < graph.node_size(); i++)
+	{
+		graphNodes.insert(graph.node(i).name());
+	}
+}
+
+void CPUBackend::convolve(const ConvLayer& layer, const float* in, int samples, float* out, const float* residual, bool relu)
+{
+	int pixels = samples * BOARD_PIXELS;
+	int tiles = (pixels + CONV_TILE_PIXELS - 1) / CONV_TILE_PIXELS;
+	int tasksPerOutputs = (tiles + CONV_TASK_TILES - 1) / CONV_TASK_TILES;
+	int tileOutputs = layer.panels.empty() ? layer.outputs : CONV_TILE_OUTPUTS;
+	if (zeros.size() < layer.inputs)
+	{
+		zeros.resize(layer.inputs, 0.0f);
+		quantizedZeros.resize(layer.inputs, 0);
+	}
+
+	if (layer.isQuantized()) // Inputs are outputs of relu
+	{
+		quantizedInput.resize(pixels * layer.inputs);
+		float inverse = 1.0f / layer.inputScale;
+		pool.run(samples, [&](int i)
+		{
+			const float* from = in + i * BOARD_PIXELS * layer.inputs;
+			uint8_t* to = quantizedInput.data() + i * BOARD_PIXELS * layer.inputs;
+			for (int k = 0; k < BOARD_PIXELS * layer.inputs; k++)
+			{
+				to[k] = uint8_t(__MIN(__MAX(from[k], 0.0f) * inverse + 0.5f, float(QUANT_MAX_ACTIVATION)));
+			}
+		});
+	}
+
+	pool.run(tasksPerOutputs * (layer.outputs / tileOutputs), [&](int task)
+	{
+		int from = (task / tasksPerOutputs) * tileOutputs;
+		int firstTile = (task % tasksPerOutputs) * CONV_TASK_TILES;
+		for (int tile = firstTile; tile < __MIN(firstTile + CONV_TASK_TILES, tiles); tile++)
+		{
+			int first = tile * CONV_TILE_PIXELS;
+			int count = __MIN(CONV_TILE_PIXELS, pixels - first);
+			float* o = out + first * layer.outputs;
+			const float* r = residual != nullptr ? residual + first * layer.outputs : nullptr;
+
+			if (layer.isQuantized())
+			{
+				const uint8_t* rows[9][CONV_TILE_PIXELS]; // Up to 3x3 kernel
+				gatherTile(layer, quantizedInput.data(), quantizedZeros.data(), first, count, rows);
+				convolveTileQuantized(layer, rows, count, from, from + tileOutputs, o, r, relu);
+			}
+			else
+			{
+				const float* rows[9][CONV_TILE_PIXELS];
+				gatherTile(layer, in, zeros.data(), first, count, rows);
+				convolveTile(layer, rows, count, from, from + tileOutputs, o, r, relu);
+			}
+		}
+	});
+}
+
+static std::vector<tensorflow::Tensor> fetchVariables(tensorflow::Session* session, const std::vector<std::string>& names)
+{
+	std::vector<tensorflow::Tensor> values;
+	TF_CHECK_OK(session->Run({}, names, {}, &values));
+	return values;
+}
+
+static ConvLayer fetchConv(tensorflow::Session* session, std::string kernelName, std::string bnName)
+{
+	std::vector<tensorflow::Tensor> v = fetchVariables(session, { kernelName, bnName + "/gamma", bnName + "/beta", bnName + "/moving_mean", bnName + "/moving_variance" });
+
+	ConvLayer layer;
+	layer.kernel = v[0].dim_size(0);
+	layer.inputs = v[0].dim_size(2);
+	layer.outputs = v[0].dim_size(3);
+	const float* kernel = v[0].flat<float>().data();
+	layer.weights.assign(kernel, kernel + v[0].NumElements());
+	layer.bias.assign(layer.outputs, 0.0f);
+	layer.fold(v[1].flat<float>().data(), v[2].flat<float>().data(), v[3].flat<float>().data(), v[4].flat<float>().data());
+	layer.pack();
+	return layer;
+}
+
+static DenseLayer fetchDense(tensorflow::Session* session, std::string name)
+{
+	std::vector<tensorflow::Tensor> v = fetchVariables(session, { name + "/kernel", name + "/bias" });
+
+	DenseLayer layer;
+	layer.inputs = v[0].dim_size(0);
+	layer.outputs = v[0].dim_size(1);
+	const float* kernel = v[0].flat<float>().data();
+	const float* bias = v[1].flat<float>().data();
+	layer.weights.assign(kernel, kernel + v[0].NumElements());
+	layer.bias.assign(bias, bias + layer.outputs);
+	return layer;
+}
+
+/*
+	Variable names follow layer names of build_graph.py, dense layers are named in order of creation
+*/
+std::shared_ptr<ResidualNetwork> ResidualNetwork::fetch(tensorflow::Session* session, const std::unordered_set<std::string>& graphNodes)
+{
+	std::shared_ptr<ResidualNetwork> net(new ResidualNetwork());
+
+	std::vector<tensorflow::Tensor> v = fetchVariables(session, { "conv/kernel", "conv_bn/gamma", "conv_bn/beta", "conv_bn/moving_mean", "conv_bn/moving_variance" });
+	net->stem.kernel = v[0].dim_size(0);
+	net->stem.inputs = v[0].dim_size(2);
+	net->stem.outputs = v[0].dim_size(3);
+	const float* kernel = v[0].flat<float>().data();
+	net->stem.weights.assign(kernel, kernel + v[0].NumElements());
+	net->stem.bias.assign(net->stem.outputs, 0.0f);
+	net->stem.pack();
+	for (int y = 0; y < v[1].NumElements(); y++)
+	{
+		float scale = v[1].flat<float>()(y) / std::sqrt(v[4].flat<float>()(y) + BN_EPSILON);
+		net->stemRowScale.push_back(scale);
+		net->stemRowShift.push_back(v[2].flat<float>()(y) - v[3].flat<float>()(y) * scale);
+	}
+
+	for (int i = 0; ; i++)
+	{
+		std::string block = std::to_string(i) + char('a' + i);
+		if (!graphNodes.contains("res" + block + "_branch2a/kernel"))
+		{
+			break;
+		}
+		net->blocks.push_back(fetchConv(session, "res" + block + "_branch2a/kernel", "bn" + block + "_branch2a"));
+		net->blocks.push_back(fetchConv(session, "res" + block + "_branch2b/kernel", "bn" + block + "_branch2b"));
+	}
+
+	net->policyConv = fetchConv(session, "pi/kernel", "bn_pi");
+	net->policyDense = fetchDense(session, "dense");
+	net->valueConv = fetchConv(session, "v/kernel", "bn_v");
+	net->valueHidden = fetchDense(session, "dense_1");
+	net->valueDense = fetchDense(session, "dense_2");
+
+	printf("Loaded residual network with %d blocks of %d filters\n", (int)net->blocks.size() / 2, net->stem.outputs);
+	return net;
+}
+
+/*
+	Input of each block convolution is quantized to its max over calibration positions, float network is run to find them
+*/
+void CPUBackend::quantizeNetwork(ResidualNetwork& net)
+{
+	int samples = calibration.size() / TF_INPUT_TENSOR_SIZE;
+	std::vector<float> inputMax(net.blocks.size(), 0.0f);
+	std::vector<float> policy(CALIBRATION_BATCH * TF_OUTPUT_POLICY_TENSOR_SIZE);
+	std::vector<float> value(CALIBRATION_BATCH * TF_OUTPUT_VALUE_TENSOR_SIZE);
+	for (int i = 0; i < samples; i += CALIBRATION_BATCH)
+	{
+		forward(net, calibration.data() + i * TF_INPUT_TENSOR_SIZE, __MIN(CALIBRATION_BATCH, samples - i), policy.data(), value.data(), &inputMax);
+	}
+
+	int count = 0;
+	for (int b = 0; b < net.blocks.size(); b++)
+	{
+		count += net.blocks[b].quantize(inputMax[b]);
+	}
+	printf("CPU backend quantized %d of %d block convolutions to 8 bits on %d calibration positions\n", count, (int)net.blocks.size(), samples);
+}
+
+void CPUBackend::loadWeights()
+{
+#ifndef _DEBUG
+	std::shared_ptr<ResidualNetwork> net = ResidualNetwork::fetch(session, graphNodes);
+#else
+	std::shared_ptr<ResidualNetwork> net = ResidualNetwork::createRandom(CPU_DEBUG_FILTERS, CPU_DEBUG_BLOCKS);
+#endif // !_DEBUG
+
+	if (quantized)
+	{
+		std::lock_guard<std::mutex> guard(runLock);
+		if (calibration.empty())
+		{
+			printf("CPU backend has no calibration positions, network runs in float\n");
+		}
+		else
+		{
+			quantizeNetwork(*net);
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(weightsLock);
+	network = net;
+}
+
+bool CPUBackend::calibrate(const float* inputs, int samples)
+{
+	if (!quantized)
+	{
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(runLock);
+		calibration.assign(inputs, inputs + samples * TF_INPUT_TENSOR_SIZE);
+	}
+	loadWeights(); // Ranges are only valid for weights they were measured on, every load calibrates again
+	return true;
+}
+
+float* CPUBackend::getInput(int slot, int samples)
+{
+	Slot& s = slots[slot];
+	if (s.input.size() < samples * TF_INPUT_TENSOR_SIZE)
+	{
+		s.input.resize(__MAX(samples, SETTINGS.NN_MAX_BATCH) * TF_INPUT_TENSOR_SIZE);
+	}
+	return s.input.data();
+}
+
+void CPUBackend::forward(const ResidualNetwork& net, const float* input, int samples, float* policy, float* value, std::vector<float>* inputMax)
+{
+	int filters = net.stem.outputs;
+	for (auto& a : activations)
+	{
+		a.resize(samples * BOARD_PIXELS * filters);
+	}
+	float* tower = activations[0].data();
+	float* middle = activations[1].data();
+	float* next = activations[2].data();
+
+	convolve(net.stem, input, samples, tower, nullptr, false);
+	pool.run(samples, [&](int i)
+	{
+		float* t = tower + i * BOARD_PIXELS * filters;
+		for (int p = 0; p < BOARD_PIXELS; p++, t += filters)
+		{
+			int y = p / MAP_X;
+			for (int f = 0; f < filters; f++)
+			{
+				t[f] = __MAX(t[f] * net.stemRowScale[y] + net.stemRowShift[y], 0.0f);
+			}
+		}
+	});
+
+	auto recordMax = [&](int b, const float* in)
+	{
+		if (inputMax != nullptr)
+		{
+			float& m = (*inputMax)[b];
+			m = __MAX(m, *std::max_element(in, in + samples * BOARD_PIXELS * filters));
+		}
+	};
+	for (int b = 0; b < net.blocks.size(); b += 2)
+	{
+		recordMax(b, tower);
+		convolve(net.blocks[b], tower, samples, middle, nullptr, true);
+		recordMax(b + 1, middle);
+		convolve(net.blocks[b + 1], middle, samples, next, tower, true);
+		std::swap(tower, next);
+	}
+
+	pool.run(samples, [&](int i)
+	{
+		net.evaluateHeads(tower + i * BOARD_PIXELS * filters, policy + i * TF_OUTPUT_POLICY_TENSOR_SIZE, value + i * TF_OUTPUT_VALUE_TENSOR_SIZE);
+	});
+}
+
+void CPUBackend::run(int slot, int samples)
+{
+	std::shared_ptr<ResidualNetwork> net;
+	{
+		std::lock_guard<std::mutex> guard(weightsLock);
+		net = network;
+	}
+	if (net == nullptr)
+	{
+		throw std::runtime_error("CPU backend run before weights were loaded");
+	}
+
+	Slot& s = slots[slot];
+	s.policy.resize(samples * TF_OUTPUT_POLICY_TENSOR_SIZE);
+	s.value.resize(samples * TF_OUTPUT_VALUE_TENSOR_SIZE);
+
+	std::lock_guard<std::mutex> guard(runLock);
+	forward(*net, s.input.data(), samples, s.policy.data(), s.value.data(), nullptr);
+}
+
+const float* CPUBackend::getPolicy(int slot)
+{
+	return slots[slot].policy.data();
+}
+
+const float* CPUBackend::getValue(int slot)
+{
+	return slots[slot].value.data();
+}
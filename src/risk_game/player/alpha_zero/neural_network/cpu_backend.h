@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include "inference_backend.h"
+
+static const float BN_EPSILON = 0.001f; // Default of tf layers batch normalization
+static const int BOARD_PIXELS = MAP_Y * MAP_X;
+static const int CONV_TILE_PIXELS = 6; // Output pixels of micro tile, with two vectors of outputs each accumulators fit in registers
+static const int CONV_TILE_OUTPUTS = 16; // Packed weight panel of one tile fits in L2 cache for 3x3 kernel with 256 inputs
+static const int CONV_TASK_TILES = 8; // Tiles of one parallel task, they reuse same weight panel from cache
+static const int CPU_DEBUG_FILTERS = 32; // Random network of debug build, there is no session to load weights from
+static const int CPU_DEBUG_BLOCKS = 2;
+static const int CPU_DEBUG_VALUE_HIDDEN = 256;
+static const int CPU_DEBUG_SEED = 1;
+static const int QUANT_GROUP = 4; // Input channels summed by one 8 bit multiply add lane
+static const int QUANT_MAX_ACTIVATION = 127; // Unsigned 7 bit, pair sums of 8 bit multiply add can not saturate 16 bits
+static const int QUANT_MAX_WEIGHT = 127;
+static const int CALIBRATION_BATCH = 32; // Samples of one calibration forward pass
+
+
+class WorkerPool // Runs tasks of one job on all threads, caller included
+{
+private:
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable cvJob;
+	std::condition_variable cvDone;
+
+	const std::function<void(int)>* job = nullptr;
+	int tasks = 0;
+	std::atomic<int> nextTask = 0;
+	int busyThreads = 0;
+	uint64_t generation = 0;
+	bool stopping = false;
+
+	void threadWork();
+	void work(const std::function<void(int)>& job, int tasks); // Takes tasks till none is left
+
+public:
+	WorkerPool(int threads); // Threads beside caller
+	~WorkerPool();
+
+	void run(int tasks, const std::function<void(int)>& job); // Blocks till all tasks are done, called by one thread at a time
+};
+
+class ConvLayer // Same padding, batch normalization is folded into weights and bias
+{
+public:
+	int kernel = 1;
+	int inputs = 0;
+	int outputs = 0;
+	std::vector<float> weights; // Layout of tf kernel [kernel][kernel][inputs][outputs]
+	std::vector<float> bias;
+	std::vector<float> panels; // Weights by tile outputs [outputs / CONV_TILE_OUTPUTS][kernel][kernel][inputs][CONV_TILE_OUTPUTS], read sequentially by tile
+
+	float inputScale = 0.0f; // Step of 8 bit input, zero when layer runs in float
+	std::vector<int8_t> quantizedPanels; // [outputs / CONV_TILE_OUTPUTS][kernel][kernel][inputs / QUANT_GROUP][CONV_TILE_OUTPUTS][QUANT_GROUP]
+	std::vector<float> outputScales; // Input step times weight step of output channel
+
+	void fold(const float* gamma, const float* beta, const float* mean, const float* variance);
+	void pack(); // After weights are final
+	bool quantize(float inputMax); // Per output channel weight scales, input must be non negative, false when shape does not fit kernel
+	bool isQuantized() const { return inputScale > 0.0f; }
+	void applyPixel(const float* in, float* out) const; // Only 1x1 kernel
+};
+
+class DenseLayer
+{
+public:
+	int inputs = 0;
+	int outputs = 0;
+	std::vector<float> weights; // [inputs][outputs]
+	std::vector<float> bias;
+
+	void apply(const float* in, float* out) const;
+};
+
+/*
+	Residual tower of python/src/build_graph.py for inference only, activations are NHWC as input tensor.
+	Stem batch normalization is over board rows (axis 1) as in graph, it can not be folded so it is applied after stem convolution.
+*/
+class ResidualNetwork
+{
+public:
+	ConvLayer stem;
+	std::vector<float> stemRowScale; // [MAP_Y]
+	std::vector<float> stemRowShift;
+	std::vector<ConvLayer> blocks; // Two convolutions per residual block
+
+	ConvLayer policyConv;
+	DenseLayer policyDense;
+
+	ConvLayer valueConv;
+	DenseLayer valueHidden;
+	DenseLayer valueDense;
+
+	void evaluateHeads(const float* tower, float* policy, float* value) const; // One sample
+	static std::shared_ptr<ResidualNetwork> fetch(tensorflow::Session* session, const std::unordered_set<std::string>& graphNodes); // Variables of session, residual blocks are counted from graph nodes
+	static std::shared_ptr<ResidualNetwork> createRandom(int filters, int blocks);
+};
+
+/*
+	Native inference of residual tower on cpu, weights are read from variables of session.
+	Convolutions run as direct convolution over tiles of output pixels, AVX2 micro kernel when built with it.
+	Quantized backend runs 3x3 convolutions of residual blocks in 8 bits, activation ranges are calibrated on positions given by calibrate.
+	Stem and heads stay in float, they are small and closest to inputs and outputs.
+*/
+class CPUBackend : public InferenceBackend
+{
+private:
+	class Slot
+	{
+	public:
+		std::vector<float> input;
+		std::vector<float> policy;
+		std::vector<float> value;
+	};
+
+	tensorflow::Session* session;
+	bool quantized;
+	std::unordered_set<std::string> graphNodes; // Residual blocks are counted from variables of graph
+	std::mutex weightsLock; // Weights are replaced while other thread runs
+	std::shared_ptr<ResidualNetwork> network;
+	std::vector<Slot> slots;
+	std::vector<float> calibration; // Encoded positions of activation ranges
+
+	std::mutex runLock; // Pool and buffers, calibration runs on caller of loadWeights
+	WorkerPool pool;
+	std::vector<float> activations[3]; // Tower, block middle and block output
+	std::vector<uint8_t> quantizedInput;
+	std::vector<float> zeros; // Padding pixel
+	std::vector<uint8_t> quantizedZeros;
+
+	void convolve(const ConvLayer& layer, const float* in, int samples, float* out, const float* residual, bool relu);
+	void forward(const ResidualNetwork& net, const float* input, int samples, float* policy, float* value, std::vector<float>* inputMax); // Caller holds run lock, inputMax is max input of each block convolution
+	void quantizeNetwork(ResidualNetwork& net);
+
+public:
+	CPUBackend(int slots, tensorflow::Session* session, const tensorflow::GraphDef& graph, bool quantized);
+
+	void loadWeights() override;
+	bool calibrate(const float* inputs, int samples) override;
+	float* getInput(int slot, int samples) override;
+	void run(int slot, int samples) override;
+	const float* getPolicy(int slot) override;
+	const float* getValue(int slot) override;
+};
@@ -0,0 +1,247 @@
+#include "inference_backend.h"
+#include "alphazero_nn.h"
+#include "cpu_backend.h"
+
+#include <thread>
+
+std::unique_ptr<InferenceBackend> InferenceBackend::create(std::string name, int slots, tensorflow::Session* session, const tensorflow::GraphDef& graph)
+{
+	if (name == BACKEND_TF)
+	{
+		return std::unique_ptr<InferenceBackend>(new TFBackend(slots, session));
+	}
+	else if (name == BACKEND_TF_FROZEN)
+	{
+		return std::unique_ptr<InferenceBackend>(new TFFrozenBackend(slots, session, graph));
+	}
+	else if (name == BACKEND_CPU)
+	{
+		return std::unique_ptr<InferenceBackend>(new CPUBackend(slots, session, graph, false));
+	}
+	else if (name == BACKEND_CPU_INT8)
+	{
+		return std::unique_ptr<InferenceBackend>(new CPUBackend(slots, session, graph, true));
+	}
+	else if (name == BACKEND_SYNTHETIC)
+	{
+		return std::unique_ptr<InferenceBackend>(new SyntheticBackend(slots));
+	}
+	throw std::invalid_argument("Unknown inference backend " + name);
+}
+
+bool InferenceBackend::needsModel(std::string name)
+{
+	return name != BACKEND_SYNTHETIC;
+}
+
+float* TFBackend::getInput(int slot, int samples)
+{
+	Slot& s = slots[slot];
+#ifndef _DEBUG
+	if (s.inputRows < samples)
+	{
+		s.inputRows = __MAX(samples, SETTINGS.NN_MAX_BATCH);
+		s.input = tensorflow::Tensor(tensorflow::DT_FLOAT, tensorflow::TensorShape({ s.inputRows, MAP_Y, MAP_X, TF_INPUT_FEATURES }));
+	}
+	return s.input.flat<float>().data();
+#else
+	s.encoded.resize(samples * TF_INPUT_TENSOR_SIZE);
+	return s.encoded.data();
+#endif // !_DEBUG
+}
+
+void TFBackend::run(int slot, int samples)
+{
+	Slot& s = slots[slot];
+#ifndef _DEBUG
+	s.outTensors.clear();
+	TF_CHECK_OK(session->Run({ {TF_INPUT_STATE, s.input.Slice(0, samples) }, {TF_INPUT_TRAINING, FALSE_TENSOR} },
+		{ TF_OUTPUT_POLICY, TF_OUTPUT_VALUE }, {}, &s.outTensors));
+#else
+	s.policy.clear();
+	s.value.clear();
+	for (int i = 0; i < samples; i++)
+	{
+		NNOutputData out = NNOutputData::createRandom();
+		s.policy.insert(s.policy.end(), out.policy.begin(), out.policy.end());
+		s.value.push_back(out.value);
+	}
+#endif // !_DEBUG
+}
+
+const float* TFBackend::getPolicy(int slot)
+{
+#ifndef _DEBUG
+	return slots[slot].outTensors[0].flat<float>().data();
+#else
+	return slots[slot].policy.data();
+#endif // !_DEBUG
+}
+
+const float* TFBackend::getValue(int slot)
+{
+#ifndef _DEBUG
+	return slots[slot].outTensors[1].flat<float>().data();
+#else
+	return slots[slot].value.data();
+#endif // !_DEBUG
+}
+
+TFFrozenBackend::TFFrozenBackend(int slots, tensorflow::Session* session, const tensorflow::GraphDef& graph) : TFBackend(slots, session)
+{
+	for (int i = 0; i < graph.node_size(); i++)
+	{
+		graphNodes.insert(graph.node(i).name());
+		if (device.empty())
+		{
+			device = graph.node(i).device();
+		}
+	}
+}
+
+tensorflow::GraphDef TFFrozenBackend::buildGraph(const ResidualNetwork& net)
+{
+	using namespace tensorflow;
+	Scope root = Scope::NewRootScope().WithDevice(device);
+
+	auto constant = [&root](const std::vector<float>& values, const std::vector<int>& dims) -> Output
+	{
+		TensorShape shape;
+		for (int d : dims)
+		{
+			shape.AddDim(d);
+		}
+		Tensor t(DT_FLOAT, shape);
+		std::copy(values.begin(), values.end(), t.flat<float>().data());
+		return ops::Const(root, t);
+	};
+	auto conv = [&](Output in, const ConvLayer& layer) -> Output // Folded bias
+	{
+		Output filter = constant(layer.weights, { layer.kernel, layer.kernel, layer.inputs, layer.outputs });
+		return ops::BiasAdd(root, ops::Conv2D(root, in, filter, { 1, 1, 1, 1 }, "SAME"), constant(layer.bias, { layer.outputs }));
+	};
+	auto dense = [&](Output in, const DenseLayer& layer) -> Output
+	{
+		return ops::BiasAdd(root, ops::MatMul(root, in, constant(layer.weights, { layer.inputs, layer.outputs })), constant(layer.bias, { layer.outputs }));
+	};
+
+	Output input = ops::Placeholder(root.WithOpName(TF_INPUT_STATE), DT_FLOAT);
+	Output stem = ops::Conv2D(root, input, constant(net.stem.weights, { net.stem.kernel, net.stem.kernel, net.stem.inputs, net.stem.outputs }), { 1, 1, 1, 1 }, "SAME");
+	stem = ops::Add(root, ops::Mul(root, stem, constant(net.stemRowScale, { MAP_Y, 1, 1 })), constant(net.stemRowShift, { MAP_Y, 1, 1 })); // Normalization over rows
+	Output tower = ops::Relu(root, stem);
+	for (int b = 0; b < net.blocks.size(); b += 2)
+	{
+		Output middle = ops::Relu(root, conv(tower, net.blocks[b]));
+		tower = ops::Relu(root, ops::Add(root, conv(middle, net.blocks[b + 1]), tower));
+	}
+
+	Output policy = ops::Reshape(root, ops::Relu(root, conv(tower, net.policyConv)), { -1, BOARD_PIXELS * net.policyConv.outputs });
+	ops::Softmax(root.WithOpName(TF_OUTPUT_POLICY), dense(policy, net.policyDense));
+
+	Output value = ops::Reshape(root, ops::Relu(root, conv(tower, net.valueConv)), { -1, BOARD_PIXELS * net.valueConv.outputs });
+	value = ops::Relu(root, dense(value, net.valueHidden));
+	ops::Tanh(root.WithOpName(TF_OUTPUT_VALUE), dense(value, net.valueDense));
+
+	GraphDef graph;
+	TF_CHECK_OK(root.ToGraphDef(&graph));
+	return graph;
+}
+
+void TFFrozenBackend::loadWeights()
+{
+#ifndef _DEBUG
+	tensorflow::GraphDef graph = buildGraph(*ResidualNetwork::fetch(session, graphNodes));
+
+	tensorflow::SessionOptions opts;
+	opts.config.mutable_gpu_options()->set_allow_growth(true);
+	opts.config.mutable_graph_options()->mutable_optimizer_options()->set_opt_level(tensorflow::OptimizerOptions::L1); // Constant folding and common subexpression elimination, grappler rewrites run by default
+	std::shared_ptr<tensorflow::Session> inference(tensorflow::NewSession(opts), [](tensorflow::Session* s) { s->Close(); delete s; });
+	TF_CHECK_OK(inference->Create(graph));
+
+	tensorflow::Tensor warmUp(tensorflow::DT_FLOAT, tensorflow::TensorShape({ 1, MAP_Y, MAP_X, TF_INPUT_FEATURES })); // Graph is optimized on first run, not on first batch
+	std::fill(warmUp.flat<float>().data(), warmUp.flat<float>().data() + warmUp.NumElements(), 0.0f);
+	std::vector<tensorflow::Tensor> outputs;
+	TF_CHECK_OK(inference->Run({ { TF_INPUT_STATE, warmUp } }, { TF_OUTPUT_POLICY, TF_OUTPUT_VALUE }, {}, &outputs));
+	printf("Built inference graph with %d nodes\n", graph.node_size());
+
+	std::lock_guard<std::mutex> guard(sessionLock);
+	inferenceSession = inference;
+#endif // !_DEBUG
+}
+
+void TFFrozenBackend::run(int slot, int samples)
+{
+#ifndef _DEBUG
+	std::shared_ptr<tensorflow::Session> inference;
+	{
+		std::lock_guard<std::mutex> guard(sessionLock);
+		inference = inferenceSession;
+	}
+	if (inference == nullptr)
+	{
+		throw std::runtime_error("Frozen tf backend run before weights were loaded");
+	}
+
+	Slot& s = slots[slot];
+	s.outTensors.clear();
+	TF_CHECK_OK(inference->Run({ { TF_INPUT_STATE, s.input.Slice(0, samples) } }, { TF_OUTPUT_POLICY, TF_OUTPUT_VALUE }, {}, &s.outTensors));
+#else
+	TFBackend::run(slot, samples);
+#endif // !_DEBUG
+}
+
+static float nextUniform(uint64_t& state) // Splitmix64, [0, 1)
+{
+	state += 0x9E3779B97F4A7C15ULL;
+	uint64_t z = state;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return float((z ^ (z >> 31)) >> 40) / float(1 << 24);
+}
+
+float* SyntheticBackend::getInput(int slot, int samples)
+{
+	Slot& s = slots[slot];
+	if (s.input.size() < samples * TF_INPUT_TENSOR_SIZE)
+	{
+		s.input.resize(__MAX(samples, SETTINGS.NN_MAX_BATCH) * TF_INPUT_TENSOR_SIZE);
+	}
+	return s.input.data();
+}
+
+void SyntheticBackend::run(int slot, int samples)
+{
+	auto done = std::chrono::steady_clock::now() + std::chrono::microseconds(SETTINGS.SYNTHETIC_BATCH_LATENCY_US + samples * SETTINGS.SYNTHETIC_SAMPLE_LATENCY_US);
+
+	Slot& s = slots[slot];
+	s.policy.resize(samples * TF_OUTPUT_POLICY_TENSOR_SIZE);
+	s.value.resize(samples * TF_OUTPUT_VALUE_TENSOR_SIZE);
+	for (int i = 0; i < samples; i++)
+	{
+		uint64_t state = XXH64(s.input.data() + i * TF_INPUT_TENSOR_SIZE, TF_INPUT_TENSOR_SIZE * sizeof(float), 0);
+		float* policy = s.policy.data() + i * TF_OUTPUT_POLICY_TENSOR_SIZE;
+		float sum = 0.0f;
+		for (int j = 0; j < TF_OUTPUT_POLICY_TENSOR_SIZE; j++)
+		{
+			policy[j] = nextUniform(state) + SYNTHETIC_MIN_PRIOR;
+			sum += policy[j];
+		}
+		for (int j = 0; j < TF_OUTPUT_POLICY_TENSOR_SIZE; j++)
+		{
+			policy[j] /= sum;
+		}
+		s.value[i] = nextUniform(state) * 2 - 1;
+	}
+
+	std::this_thread::sleep_until(done); // Device is busy, caller thread waits as for session run
+}
+
+const float* SyntheticBackend::getPolicy(int slot)
+{
+	return slots[slot].policy.data();
+}
+
+const float* SyntheticBackend::getValue(int slot)
+{
+	return slots[slot].value.data();
+}
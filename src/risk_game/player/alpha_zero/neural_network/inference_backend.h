@@ -0,0 +1,121 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "tensorflow/core/framework/graph.pb.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/public/session.h"
+
+#include "alphazero_nn_data.h"
+
+static const std::string BACKEND_TF = "tf";
+static const std::string BACKEND_TF_FROZEN = "tf-frozen";
+static const std::string BACKEND_CPU = "cpu";
+static const std::string BACKEND_CPU_INT8 = "cpu-int8";
+static const std::string BACKEND_SYNTHETIC = "synthetic";
+static const float SYNTHETIC_MIN_PRIOR = 0.5f; // Added to every random prior, as in NNOutputData::createRandom
+
+
+class ResidualNetwork;
+
+/*
+	Inference engine under AlphaZeroNN, session is kept for training and checkpoints and is source of weights.
+	Each slot is own batch buffer, so batch can be encoded and decoded while other slot runs.
+	Run is called only by one thread at a time, holder of device.
+*/
+class InferenceBackend
+{
+public:
+	virtual ~InferenceBackend() = default;
+
+	virtual void loadWeights() = 0; // Weights in session changed, thread safe
+	virtual bool calibrate(const float*, int) { return false; }; // Encoded positions for activation ranges of quantized backend, thread safe, true when outputs changed
+	virtual float* getInput(int slot, int samples) = 0; // Encoded batch of samples * TF_INPUT_TENSOR_SIZE floats, valid till slot is run
+	virtual void run(int slot, int samples) = 0;
+	virtual const float* getPolicy(int slot) = 0; // Softmax policy of samples * TF_OUTPUT_POLICY_TENSOR_SIZE floats
+	virtual const float* getValue(int slot) = 0; // Value of samples * TF_OUTPUT_VALUE_TENSOR_SIZE floats
+
+	static std::unique_ptr<InferenceBackend> create(std::string name, int slots, tensorflow::Session* session, const tensorflow::GraphDef& graph);
+	static bool needsModel(std::string name); // Graph and weights must be loaded to session
+};
+
+class TFBackend : public InferenceBackend
+{
+protected:
+	class Slot
+	{
+	public:
+		tensorflow::Tensor input; // Sliced to batch size for run
+		int inputRows = 0;
+		std::vector<tensorflow::Tensor> outTensors;
+#ifdef _DEBUG
+		std::vector<float> encoded; // Never run, outputs are random
+		std::vector<float> policy;
+		std::vector<float> value;
+#endif // _DEBUG
+	};
+
+	tensorflow::Session* session;
+	std::vector<Slot> slots;
+
+public:
+	TFBackend(int slots, tensorflow::Session* session) : session(session), slots(slots) {};
+
+	void loadWeights() override {}; // Session runs with own weights
+	float* getInput(int slot, int samples) override;
+	void run(int slot, int samples) override;
+	const float* getPolicy(int slot) override;
+	const float* getValue(int slot) override;
+};
+
+/*
+	Inference only graph built from weights of session on every load, constants are frozen and batch normalization is folded into convolutions.
+	Training switch, regularizers, losses, optimizer and save nodes are not in graph, session applies tf graph optimizations on first run.
+*/
+class TFFrozenBackend : public TFBackend
+{
+private:
+	std::unordered_set<std::string> graphNodes;
+	std::string device; // Of loaded graph
+	std::mutex sessionLock; // Session is replaced while other thread runs
+	std::shared_ptr<tensorflow::Session> inferenceSession;
+
+	tensorflow::GraphDef buildGraph(const ResidualNetwork& net);
+
+public:
+	TFFrozenBackend(int slots, tensorflow::Session* session, const tensorflow::GraphDef& graph);
+
+	void loadWeights() override;
+	void run(int slot, int samples) override;
+};
+
+/*
+	Evaluator without model for throughput tests of search, batching and games at release speed.
+	Priors and value are pseudo random from hash of encoded input, so every run sees same evaluations, run takes latency of configured device.
+*/
+class SyntheticBackend : public InferenceBackend
+{
+private:
+	class Slot
+	{
+	public:
+		std::vector<float> input;
+		std::vector<float> policy;
+		std::vector<float> value;
+	};
+
+	std::vector<Slot> slots;
+
+public:
+	SyntheticBackend(int slots) : slots(slots) {};
+
+	void loadWeights() override {};
+	float* getInput(int slot, int samples) override;
+	void run(int slot, int samples) override;
+	const float* getPolicy(int slot) override;
+	const float* getValue(int slot) override;
+};
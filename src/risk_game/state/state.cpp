@@ -765,8 +765,77 @@ void State::nextPlayerGameTurn()
     logStartingTurn();
 }
 
+int State::getAttackDice(land_army_t army)
+{
+    return army >= 4 ? 3 : army == 3 ? 2 : 1;
+}
+
+int State::getDefendDice(land_army_t army)
+{
+    return army >= 2 ? 2 : 1;
+}
+
+// Exact probabilities of battle results, enumerated over all dice rolls
+const BattleOutcomes& State::getBattleOutcomes(int attackDice, int defendDice)
+{
+    static const auto TABLE = []()
+    {
+        std::array<std::array<BattleOutcomes, 3>, 4> table{};
+        for (int a = 1; a <= 3; a++)
+        {
+            for (int d = 1; d <= 2; d++)
+            {
+                int comparisons = __MIN(a, d);
+                int count[3] = {}; // Indexed by attacker losses
+                int total = 0;
+
+                int rolls = 1;
+                for (int i = 0; i < a + d; i++) rolls *= 6;
+
+                for (int r = 0; r < rolls; r++)
+                {
+                    int dice[5];
+                    int v = r;
+                    for (int i = 0; i < a + d; i++)
+                    {
+                        dice[i] = v % 6 + 1;
+                        v /= 6;
+                    }
+                    std::sort(dice, dice + a, std::greater<int>());
+                    std::sort(dice + a, dice + a + d, std::greater<int>());
+
+                    int attackerLosses = 0;
+                    for (int c = 0; c < comparisons; c++)
+                    {
+                        if (dice[c] <= dice[a + c]) attackerLosses++; // Defender wins ties
+                    }
+                    count[attackerLosses]++;
+                    total++;
+                }
+
+                BattleOutcomes& bo = table[a][d];
+                for (int l = 0; l <= comparisons; l++)
+                {
+                    BattleOutcome& o = bo.outcome[bo.size++];
+                    o.attackerLosses = l;
+                    o.defenderLosses = comparisons - l;
+                    o.probability = float(count[l]) / total;
+                }
+            }
+        }
+        return table;
+    }();
+
+    return TABLE[attackDice][defendDice];
+}
+
+const BattleOutcomes& State::getBattleOutcomes(LandIndex from, LandIndex to) const
+{
+    return getBattleOutcomes(getAttackDice(getLandArmy(from).army), getDefendDice(getLandArmy(to).army));
+}
+
 // Assum attacking and defending with max numbers available
-bool State::attackMove(LandIndex from, LandIndex to)
+bool State::attackMove(LandIndex from, LandIndex to, const BattleOutcome* outcome)
 {
     data.attacksDuringTurn += 1;
 
@@ -825,26 +894,22 @@ bool State::attackMove(LandIndex from, LandIndex to)
     DiceRolls attackingRolls, defendingRolls;
     if (defendingLand.army > 0)
     {
-        int attackingAmount = attackLandAmount >= 4 ? 3 : attackLandAmount == 3 ? 2 : 1;
+        int attackingAmount = getAttackDice(attackLandAmount);
         attackingUnits = attackingAmount;
-        int defendingAmount = defendLandAmount >= 2 ? 2 : 1;
-
-        attackingRolls = getDiceRolls(attackingAmount);
-        defendingRolls = getDiceRolls(defendingAmount);
+        int defendingAmount = getDefendDice(defendLandAmount);
 
-        if (attackingRolls.roll1 > defendingRolls.roll1)
+        if (outcome != nullptr) // Result already decided by caller (MCTS chance node)
         {
-            defendLandAmount--;           
+            attackLandAmount -= outcome->attackerLosses;
+            attackingUnits -= outcome->attackerLosses;
+            defendLandAmount -= outcome->defenderLosses;
         }
         else
         {
-            attackLandAmount--;
-            attackingUnits--;
-        }
+            attackingRolls = getDiceRolls(attackingAmount);
+            defendingRolls = getDiceRolls(defendingAmount);
 
-        if (attackingAmount >= 2 && defendingAmount == 2)
-        {
-            if (attackingRolls.roll2 > defendingRolls.roll2)
+            if (attackingRolls.roll1 > defendingRolls.roll1)
             {
                 defendLandAmount--;
             }
@@ -853,6 +918,19 @@ bool State::attackMove(LandIndex from, LandIndex to)
                 attackLandAmount--;
                 attackingUnits--;
             }
+
+            if (attackingAmount >= 2 && defendingAmount == 2)
+            {
+                if (attackingRolls.roll2 > defendingRolls.roll2)
+                {
+                    defendLandAmount--;
+                }
+                else
+                {
+                    attackLandAmount--;
+                    attackingUnits--;
+                }
+            }
         }
     }
 
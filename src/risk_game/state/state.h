@@ -5,6 +5,9 @@
 #include <xxhash/xxhash.h>
 
 #include <stdint.h>
+#include <array>
+#include <algorithm>
+#include <functional>
 
 static constexpr int DATA_TERRITORY = static_cast<int>(LandIndex::Count);
 
@@ -46,6 +49,21 @@ public:
 	DiceRolls() : roll1(0), roll2(0), roll3(0) {}
 };
 
+class BattleOutcome // Result of single dice roll round
+{
+public:
+	uint8_t attackerLosses = 0;
+	uint8_t defenderLosses = 0;
+	float probability = 0.0f;
+};
+
+class BattleOutcomes
+{
+public:
+	BattleOutcome outcome[3];
+	uint8_t size = 0;
+};
+
 enum class RoundPhase : uint8_t
 {
 	SETUP,
@@ -118,11 +136,16 @@ private:
 	inline void resetHash();	
 
 	static DiceRolls getDiceRolls(int rolls);
+	static int getAttackDice(land_army_t army);
+	static int getDefendDice(land_army_t army);
 	void logStartingTurn();
 public:
 	static const int DRAW = -2;
 	static const int NOT_ENDED = -1;
 
+	static const BattleOutcomes& getBattleOutcomes(int attackDice, int defendDice);
+	const BattleOutcomes& getBattleOutcomes(LandIndex from, LandIndex to) const;
+
 	State();	
 	void newGame();
 
@@ -195,7 +218,7 @@ public: // Player exposed methods
 	void addLandArmy(LandIndex landIndex, land_army_t value);
 	void addLandArmy(uint8_t landIndex, land_army_t value);	
 
-	bool attackMove(LandIndex from, LandIndex to);
+	bool attackMove(LandIndex from, LandIndex to, const BattleOutcome* outcome = nullptr);
 	void attackReinforcementMove(land_army_t amount);
 	void fortifyMove(land_army_t amount, LandIndex from, LandIndex to);
 	void reinforcementMove(land_army_t amount, LandIndex to);
@@ -15,6 +15,8 @@ constexpr auto __MAX(T1 x, T2  y) { return (((x) > (y)) ? (x) : (y)); }
 template<typename T1, typename T2>
 constexpr auto __MIN(T1 x, T2  y) { return (((x) < (y)) ? (x) : (y)); }
 
+static const int MCTS_MAX_ACTIVE_DESCENTS = (1 << 8) - 1; // Leaves in flight of one search, virtual loss counter of MCTS edge is 8 bits
+
 
 class Settings
 {
@@ -29,10 +31,12 @@ public:
 	std::string PLAYER_1 = "az";
 	std::string GRAPH_DEF_PB_1 = DEFAULT_GRAPH_DEF_PB;
 	std::string CHECKPOINT_1 = DEFAULT_LATEST_CHECKPOINT;
+	int ROOT_TREES_1 = 1; // Private MCTS trees of player, more than 1 is root parallel search
 
 	std::string PLAYER_2 = "sp";
 	std::string GRAPH_DEF_PB_2 = DEFAULT_GRAPH_DEF_PB;
 	std::string CHECKPOINT_2 = DEFAULT_LATEST_CHECKPOINT;
+	int ROOT_TREES_2 = 1;
 
 	std::string DEFAULT_DATA = "data";
 	std::string DEFAULT_SAMPLES = DEFAULT_DATA + "/training_samples.bin";
@@ -41,8 +45,40 @@ public:
 	int NUMBER_OF_GPUS = 1;
 	int NUMBER_OF_CONCURENT_GAMES_PER_GPU = 4;
 	int AVG_PRED_BATCH_SIZE = 32; // 64, 128, 256
-	int THREADS_PER_MCTS = 2; // How many concurent thread are doing mcts simulation
+	int THREADS_PER_MCTS = 2; // How many concurent simulations (coroutines) are in flight per mcts search
+	int MCTS_SCHEDULER_THREADS = __MAX(1, (int)std::thread::hardware_concurrency()); // Threads shared by all mcts searches to run simulations
+	int NN_CACHE_MB = 256; // Memory cap of NN evaluation cache shared by all games, 0 disables cache
+	int MCTS_LEAVES_PER_DESCENT = 1; // Leaves collected with virtual loss by one simulation job before single batched NN request
 	int MCTS_SIMULATIONS = 32; // 32; //300; // How many MCTS simulations for each search step
+	int MCTS_MOVE_TIME_MS = 0; // Wall clock limit of one search, 0 = no limit, with MCTS_SIMULATIONS <= 0 only time limits search
+	int MCTS_FAST_SIMULATIONS = 8; // Simulations of fast search, used only to pick move
+	float MCTS_FULL_SEARCH_PROBABILITY = 1.0f; // Playout cap randomization, only full searches are recorded as training samples, 1 = every position
+	bool MCTS_EARLY_STOP = false; // Stop search when second most visited root move can not catch leader in remaining simulations, only searches of greedy not recorded moves
+	bool MCTS_CARRY_SAVED_SIMULATIONS = false; // Simulations saved by early stop are added to later searches of same game
+	bool MCTS_ADAPTIVE_BUDGET = false; // Reduce simulations in mechanical phases and when network prior is confident
+	bool MCTS_GUMBEL_ROOT = false; // Root search with gumbel top-k sampling and sequential halving, better for low simulation counts
+	int GUMBEL_SAMPLED_MOVES = 8; // Moves sampled at root for sequential halving
+	bool MACRO_REINFORCEMENT = false; // Whole turn reinforcement is single decision, searched policy is split between lands
+	bool SKIP_FORCED_MOVES = false; // Positions with single valid move are played without search and not stored in tree or training samples
+	bool MCTS_PONDER = false; // AlphaZero player searches during opponent turn, with low NN priority
+	bool MCTS_DAG_BACKUP = false; // Transpositions share statistics, deterministic edge value is value of child node
+	bool MCTS_CHANCE_NODES = false; // Branch attack moves over exact battle outcomes instead of rolling dice during search
+	float HYBRID_NN_WEIGHT = 1.0f; // Share of NN in MCTS leaf evaluation, rest is heuristic evaluator, 0 = search without NN
+	int ROLLOUT_DEPTH = 0; // Moves of heuristic rollout before leaf value is taken, 0 = static heuristic value
+	int NN_MAX_BATCH = 256; // Predictions in one NN batch
+	int NN_MAX_WAIT_US = 2000; // Oldest request waits at most this long before partial batch is run
+	int NN_BATCH_LOG_INTERVAL = 1000; // Batches between batch size and queue wait histograms in log, 0 = no log
+	std::string NN_BACKEND = "tf"; // Inference engine of NN predictions, tf session, frozen inference graph, native cpu residual network or synthetic evaluator without model
+	int NN_CPU_THREADS = __MAX(1, (int)std::thread::hardware_concurrency()); // Threads of native cpu inference, caller included
+	std::string SELF_PLAY_BACKEND = ""; // Inference engine of self play games only, comparison games keep NN_BACKEND, empty = NN_BACKEND
+	int NN_CALIBRATION_SAMPLES = 256; // Stored positions of activation ranges of quantized backend
+	int SYNTHETIC_BATCH_LATENCY_US = 1000; // Simulated run time of synthetic backend, fixed per batch
+	int SYNTHETIC_SAMPLE_LATENCY_US = 10; // Simulated run time of synthetic backend, added per sample
+	int MCTS_TREE_NODE_BUDGET = 0; // Nodes of one MCTS tree before least visited leaves are evicted, checked before each search, 0 = unlimited
+	int MCTS_PROCESS_NODE_BUDGET = 0; // Nodes of all MCTS trees in process before least visited leaves are evicted, 0 = unlimited
+
+	int MCTS_TREE_STATS_INTERVAL = 0; // Searched moves of one game between tree stats reports, 0 = no report
+	bool MCTS_TREE_STATS_JSON = false; // Tree stats as JSON lines instead of CSV
 
 	bool LOG_STATE = false;
 	bool LOG_NN_TRAINING = true;
@@ -68,6 +104,7 @@ public:
 	bool INCLUDE_COMPARE_GAMES_TRAIN_SAMPLES = true; // include compared games into training samples
 	int BENCHMARK_GAMES_RANDOM = 10; // Number of games during comparions if model is improved
 	int BENCHMARK_GAMES_SCRIPT = 100; // Number of games during comparions if model is improved
+	int SEARCH_BENCHMARK_POSITIONS = 100; // Positions of search-bench mode
 
 	bool TRAINING_REVERT_MODEL = true; // When model fails to improve, revert to best current model
 	int EPOCHS = 10;
@@ -90,21 +127,27 @@ public:
 	{
 		cxxopts::Options options("AlphaZero-Risk", "AlphaZero implementation for game Risk");
 		options.add_options()
-			("m", "Mode [train/play]", cxxopts::value<std::string>()->default_value(MODE))
+			("m", "Mode [train/play/search-bench/nn-bench]", cxxopts::value<std::string>()->default_value(MODE))
+			("bench-positions", "Number of positions in search-bench mode", cxxopts::value<int>()->default_value(std::to_string(SEARCH_BENCHMARK_POSITIONS)))
 			("g", "Default graph file path", cxxopts::value<std::string>()->default_value(DEFAULT_GRAPH_DEF_PB))
 			("c", "Checkpoint file path", cxxopts::value<std::string>()->default_value(DEFAULT_LATEST_CHECKPOINT))
 
-			("p1", "Player 1 [az/sp]", cxxopts::value<std::string>()->default_value(PLAYER_1))
+			("p1", "Player 1 [az/hs/sp/rp]", cxxopts::value<std::string>()->default_value(PLAYER_1))
 			("g1", "Graph file path for player 1", cxxopts::value<std::string>()->default_value(GRAPH_DEF_PB_1))
+			("trees1", "MCTS trees of player 1, more than 1 is root parallel search", cxxopts::value<int>()->default_value(std::to_string(ROOT_TREES_1)))
 			("c1", "Checkpoint file path for player 1", cxxopts::value<std::string>()->default_value(CHECKPOINT_1))
 
-			("p2", "Player 2 [az/sp]", cxxopts::value<std::string>()->default_value(PLAYER_2))
+			("trees2", "MCTS trees of player 2, more than 1 is root parallel search", cxxopts::value<int>()->default_value(std::to_string(ROOT_TREES_2)))
+			("p2", "Player 2 [az/hs/sp/rp]", cxxopts::value<std::string>()->default_value(PLAYER_2))
 			("g2", "Graph file path for player 2", cxxopts::value<std::string>()->default_value(GRAPH_DEF_PB_2))
 			("c2", "Checkpoint file path for player 2", cxxopts::value<std::string>()->default_value(CHECKPOINT_2))
 
 			("gpus", "Number of gpu units", cxxopts::value<int>()->default_value(std::to_string(NUMBER_OF_GPUS)))
 			("gpu-games", "Number of concurent games per gpu", cxxopts::value<int>()->default_value(std::to_string(NUMBER_OF_CONCURENT_GAMES_PER_GPU)))
-			("t", "Number of threads", cxxopts::value<int>()->default_value(std::to_string(THREADS_PER_MCTS)))		
+			("t", "Number of concurent simulations per MCTS search", cxxopts::value<int>()->default_value(std::to_string(THREADS_PER_MCTS)))		
+			("nn-cache-mb", "Memory cap of shared NN evaluation cache in MB, 0 disables it", cxxopts::value<int>()->default_value(std::to_string(NN_CACHE_MB)))
+			("leaves", "Leaves collected per simulation job before NN request", cxxopts::value<int>()->default_value(std::to_string(MCTS_LEAVES_PER_DESCENT)))
+			("st", "Number of MCTS scheduler threads", cxxopts::value<int>()->default_value(std::to_string(MCTS_SCHEDULER_THREADS)))
 			("apbs", "Set number of games per gpu to get avg. prediction batch size", cxxopts::value<int>()->default_value(std::to_string(AVG_PRED_BATCH_SIZE)))
 
 			("lnt", "Log nn training", cxxopts::value<bool>()->default_value(std::to_string(LOG_NN_TRAINING)))
@@ -122,6 +165,34 @@ public:
 			("ti", "Number of train iterations", cxxopts::value<long>()->default_value(std::to_string(TRAIN_ITERATIONS)))
 			("tg", "Games played per train iteration", cxxopts::value<int>()->default_value(std::to_string(TRAIN_ITERATION_GAMES)))
 			("mcts", "Number of MCTS simulations", cxxopts::value<int>()->default_value(std::to_string(MCTS_SIMULATIONS)))
+			("move-time-ms", "Time limit of MCTS search in ms, 0 = no limit", cxxopts::value<int>()->default_value(std::to_string(MCTS_MOVE_TIME_MS)))
+			("mcts-fast", "Number of MCTS simulations of fast searches", cxxopts::value<int>()->default_value(std::to_string(MCTS_FAST_SIMULATIONS)))
+			("full-search-p", "Probability of full search in self play, others are fast searches", cxxopts::value<float>()->default_value(std::to_string(MCTS_FULL_SEARCH_PROBABILITY)))
+			("early-stop", "Stop search when best root move can not be overtaken", cxxopts::value<bool>()->default_value(std::to_string(MCTS_EARLY_STOP)))
+			("carry-saved", "Add simulations saved by early stop to later searches", cxxopts::value<bool>()->default_value(std::to_string(MCTS_CARRY_SAVED_SIMULATIONS)))
+			("adaptive-budget", "Scale simulations by phase and prior entropy", cxxopts::value<bool>()->default_value(std::to_string(MCTS_ADAPTIVE_BUDGET)))
+			("gumbel", "Use gumbel root search instead of PUCT", cxxopts::value<bool>()->default_value(std::to_string(MCTS_GUMBEL_ROOT)))
+			("gumbel-k", "Number of sampled root moves for gumbel search", cxxopts::value<int>()->default_value(std::to_string(GUMBEL_SAMPLED_MOVES)))
+			("macro-reinforcement", "Allocate whole turn reinforcement from single search", cxxopts::value<bool>()->default_value(std::to_string(MACRO_REINFORCEMENT)))
+			("skip-forced", "Play single option moves without search", cxxopts::value<bool>()->default_value(std::to_string(SKIP_FORCED_MOVES)))
+			("tree-stats", "Write MCTS tree stats every n searched moves, 0 = off", cxxopts::value<int>()->default_value(std::to_string(MCTS_TREE_STATS_INTERVAL)))
+			("tree-stats-json", "Write MCTS tree stats as JSON instead of CSV", cxxopts::value<bool>()->default_value(std::to_string(MCTS_TREE_STATS_JSON)))
+			("ponder", "Search during opponent turn", cxxopts::value<bool>()->default_value(std::to_string(MCTS_PONDER)))
+			("dag-backup", "Back up values over transposition DAG", cxxopts::value<bool>()->default_value(std::to_string(MCTS_DAG_BACKUP)))
+			("chance-nodes", "Expand attack dice outcomes as MCTS chance nodes", cxxopts::value<bool>()->default_value(std::to_string(MCTS_CHANCE_NODES)))
+			("nn-weight", "Share of NN in leaf evaluation, rest is heuristic, 0 = no NN", cxxopts::value<float>()->default_value(std::to_string(HYBRID_NN_WEIGHT)))
+			("rollout-depth", "Heuristic rollout moves at MCTS leaves, 0 = static value", cxxopts::value<int>()->default_value(std::to_string(ROLLOUT_DEPTH)))
+			("max-batch", "Max predictions in one NN batch", cxxopts::value<int>()->default_value(std::to_string(NN_MAX_BATCH)))
+			("max-wait-us", "Max wait of NN request before partial batch is run", cxxopts::value<int>()->default_value(std::to_string(NN_MAX_WAIT_US)))
+			("batch-log", "Write NN batch histograms every n batches, 0 = off", cxxopts::value<int>()->default_value(std::to_string(NN_BATCH_LOG_INTERVAL)))
+			("nn-backend", "NN inference backend [tf/tf-frozen/cpu/cpu-int8/synthetic]", cxxopts::value<std::string>()->default_value(NN_BACKEND))
+			("cpu-threads", "Threads of cpu NN backend", cxxopts::value<int>()->default_value(std::to_string(NN_CPU_THREADS)))
+			("self-play-backend", "NN inference backend of self play games, empty = nn-backend", cxxopts::value<std::string>()->default_value(SELF_PLAY_BACKEND))
+			("calibration-samples", "Stored positions for activation ranges of quantized NN backend", cxxopts::value<int>()->default_value(std::to_string(NN_CALIBRATION_SAMPLES)))
+			("synthetic-latency-us", "Run time of synthetic NN backend per batch", cxxopts::value<int>()->default_value(std::to_string(SYNTHETIC_BATCH_LATENCY_US)))
+			("synthetic-sample-latency-us", "Run time of synthetic NN backend per sample", cxxopts::value<int>()->default_value(std::to_string(SYNTHETIC_SAMPLE_LATENCY_US)))
+			("tree-node-budget", "Max nodes of one MCTS tree, 0 = unlimited", cxxopts::value<int>()->default_value(std::to_string(MCTS_TREE_NODE_BUDGET)))
+			("process-node-budget", "Max nodes of all MCTS trees in process, 0 = unlimited", cxxopts::value<int>()->default_value(std::to_string(MCTS_PROCESS_NODE_BUDGET)))
 			
 			("hp", "Exploration factor", cxxopts::value<float>()->default_value(std::to_string(HP_EXPLORATION)))
 			("dnv", "Dirchlet noise value", cxxopts::value<float>()->default_value(std::to_string(DIR_NOISE_VALUE)))
@@ -146,10 +217,13 @@ public:
 		}
 
 		MODE = result["m"].as<std::string>();
+		SEARCH_BENCHMARK_POSITIONS = result["bench-positions"].as<int>();
 		DEFAULT_GRAPH_DEF_PB = result["g"].as<std::string>();
 		DEFAULT_LATEST_CHECKPOINT = result["c"].as<std::string>();
 
 		PLAYER_1 = result["p1"].as<std::string>();
+		ROOT_TREES_1 = result["trees1"].as<int>();
+		ROOT_TREES_2 = result["trees2"].as<int>();
 		GRAPH_DEF_PB_1 = result["g1"].as<std::string>();
 		CHECKPOINT_1 = result["c1"].as<std::string>();
 
@@ -157,7 +231,10 @@ public:
 		GRAPH_DEF_PB_2 = result["g2"].as<std::string>();
 		CHECKPOINT_2 = result["c2"].as<std::string>();
 		
-		THREADS_PER_MCTS = result["t"].as<int>();
+		THREADS_PER_MCTS = __MIN(MCTS_MAX_ACTIVE_DESCENTS, __MAX(1, result["t"].as<int>()));
+		MCTS_SCHEDULER_THREADS = result["st"].as<int>();
+		MCTS_LEAVES_PER_DESCENT = __MIN(MCTS_MAX_ACTIVE_DESCENTS / THREADS_PER_MCTS, __MAX(1, result["leaves"].as<int>())); // Every leaf in flight can pass same edge
+		NN_CACHE_MB = __MAX(0, result["nn-cache-mb"].as<int>());
 		NUMBER_OF_GPUS = result["gpus"].as<int>();
 
 		if (result["gpu-games"].count() > 0)
@@ -179,6 +256,34 @@ public:
 		LIMIT_REINFORCEMENT_MOVES = result["limit-reinforcement"].as<bool>();
 		LIMIT_ATTACK_MOVES = result["limit-attack"].as<bool>();
 		MIRROR_GAMES = result["mirror-games"].as<bool>();
+		MCTS_CHANCE_NODES = result["chance-nodes"].as<bool>();
+		HYBRID_NN_WEIGHT = __MIN(1.0f, __MAX(0.0f, result["nn-weight"].as<float>()));
+		ROLLOUT_DEPTH = __MAX(0, result["rollout-depth"].as<int>());
+		NN_MAX_BATCH = __MAX(1, result["max-batch"].as<int>());
+		NN_MAX_WAIT_US = __MAX(0, result["max-wait-us"].as<int>());
+		NN_BATCH_LOG_INTERVAL = __MAX(0, result["batch-log"].as<int>());
+		NN_BACKEND = result["nn-backend"].as<std::string>();
+		NN_CPU_THREADS = __MAX(1, result["cpu-threads"].as<int>());
+		SELF_PLAY_BACKEND = result["self-play-backend"].as<std::string>();
+		NN_CALIBRATION_SAMPLES = __MAX(1, result["calibration-samples"].as<int>());
+		SYNTHETIC_BATCH_LATENCY_US = __MAX(0, result["synthetic-latency-us"].as<int>());
+		SYNTHETIC_SAMPLE_LATENCY_US = __MAX(0, result["synthetic-sample-latency-us"].as<int>());
+		MCTS_TREE_NODE_BUDGET = __MAX(0, result["tree-node-budget"].as<int>());
+		MCTS_PROCESS_NODE_BUDGET = __MAX(0, result["process-node-budget"].as<int>());
+		MCTS_DAG_BACKUP = result["dag-backup"].as<bool>();
+		MCTS_PONDER = result["ponder"].as<bool>();
+		MCTS_TREE_STATS_INTERVAL = result["tree-stats"].as<int>();
+		MCTS_TREE_STATS_JSON = result["tree-stats-json"].as<bool>();
+		SKIP_FORCED_MOVES = result["skip-forced"].as<bool>();
+		MACRO_REINFORCEMENT = result["macro-reinforcement"].as<bool>();
+		MCTS_MOVE_TIME_MS = result["move-time-ms"].as<int>();
+		MCTS_FAST_SIMULATIONS = result["mcts-fast"].as<int>();
+		MCTS_FULL_SEARCH_PROBABILITY = result["full-search-p"].as<float>();
+		MCTS_EARLY_STOP = result["early-stop"].as<bool>();
+		MCTS_CARRY_SAVED_SIMULATIONS = result["carry-saved"].as<bool>();
+		MCTS_ADAPTIVE_BUDGET = result["adaptive-budget"].as<bool>();
+		MCTS_GUMBEL_ROOT = result["gumbel"].as<bool>();
+		GUMBEL_SAMPLED_MOVES = result["gumbel-k"].as<int>();
 		
 		TRAIN_ITERATIONS = result["ti"].as<long>();
 		TRAIN_ITERATION_GAMES = result["tg"].as<int>();